@@ -25,463 +25,500 @@
  */
 
 #include <X11/Intrinsic.h> // for TRUE
-#include <X11/Xlib.h>
-#include <X11/extensions/XTest.h>
+#include <X11/Xlib.h>  // for XDisplayName
 #include <stdio.h>
 #include <stdlib.h>    // for atoi
 #include <unistd.h>    // for sleep
 #include <ctype.h>     // for isdigit
+#include <string.h>    // for memset
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "crikey.h"
 
 #define VERSION "0.8.4"
+#define BUFSIZE 65536
 
 static int Debug = 0;
-static int UseXTest = 1;
 static int UseStdin = 0;
-static int UseRootWin = 0;
 
-/* size of the buffer for reading from stdin */
-#define BUFSIZE 256
+static long long nowNsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
 /*
- * Non-printable characters we can handle.
- * List of character definitions is in /usr/include/X11/keysymdef.h
- * if you need to add anything.
+ * Daemon mode: keep the display connection and keymap cache open and
+ * type whatever clients send over a UNIX socket, one request at a time.
+ * A request is a series of NUL-terminated strings, which are typed
+ * with spaces between them just like command-line arguments.
+ * When it has all been sent, the daemon answers with one status byte,
+ * so the client knows the keys are out: 0 if they all were, 1 if it
+ * stopped early (a \(wait:...\) timed out, say), 2 if some keys
+ * couldn't be typed.
  */
+static volatile sig_atomic_t Quit = 0;
+
+static void quitHandler(int sig)
+{
+    Quit = 1;
+}
 
-struct {
-    char ch;
-    char* keySymName;
-} NonPrintables[] =
+/* Stop cleanly on the usual signals, so spare keycodes get emptied:
+ * the library sees Quit through opts.stop, and stops typing.
+ */
+static void catchSignals(void)
 {
-    { ' ', "space" },
-    { '\t', "Tab" },
-    { '\n', "Return" },  // for some reason this needs to be cr, not lf
-    { '\r', "Return" },
-    { '\e', "Escape" },
-    { '\010', "BackSpace" },  // \b doesn't work
-    { '\177', "Delete" },
-    { '\27', "Escape" },      // \e doesn't work
-    { '!', "exclam" },
-    { '#', "numbersign" },
-    { '%', "percent" },
-    { '$', "dollar" },
-    { '&', "ampersand" },
-    { '"', "quotedbl" },
-    { '\'', "apostrophe" },
-    { '(', "parenleft" },
-    { ')', "parenright" },
-    { '*', "asterisk" },
-    { '=', "equal" },
-    { '+', "plus" },
-    { ',', "comma" },
-    { '-', "minus" },
-    { '.', "period" },
-    { '/', "slash" },
-    { ':', "colon" },
-    { ';', "semicolon" },
-    { '<', "less" },
-    { '>', "greater" },
-    { '?', "question" },
-    { '@', "at" },
-    { '[', "bracketleft" },
-    { ']', "bracketright" },
-    { '\\', "backslash" },
-    { '^', "asciicircum" },
-    { '_', "underscore" },
-    { '`', "grave" },
-    { '{', "braceleft" },
-    { '|', "bar" },
-    { '}', "braceright" },
-    { '~', "asciitilde" },
-};
-
-/* Yuck, keyboard dependent shifts. Don't know of any other way, though. */
-static int isshift(char *keyname)
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = quitHandler;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+    sigaction(SIGHUP, &sa, 0);
+}
+
+static char* socketPath(void)
 {
-    char c = keyname[0];
-
-    /* Filter out keysyms, any string longer than 1 char */
-    /* XXX This will probably break if we ever support multibyte chars. */
-    if (keyname[1] != '\0')
-        return 0;
-
-    if (isupper(c)) return 1;
-
-    switch(c) {
-        case '~':
-        case '!':
-        case '@':
-        case '#':
-        case '$':
-        case '%':
-        case '^':
-        case '&':
-        case '*':
-        case '(':
-        case ')':
-        case '_':
-        case '+':
-        case '|':
-        case '{':
-        case '}':
-        case ':':
-        case '"':
-        case '<':
-        case '>':
-        case '?':
-            return 1;
+    static char path[sizeof ((struct sockaddr_un*)0)->sun_path];
+    char* dir = getenv("XDG_RUNTIME_DIR");
+
+    if (dir && *dir)
+        snprintf(path, sizeof path, "%s/crikey%s", dir, XDisplayName(0));
+    else
+        snprintf(path, sizeof path, "/tmp/crikey-%d%s",
+                 (int)getuid(), XDisplayName(0));
+    return path;
+}
 
+static int socketAddr(struct sockaddr_un* addr, char* path)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr->sun_path) {
+        printf("crikey: Socket path too long: %s\n", path);
+        return -1;
     }
+    strcpy(addr->sun_path, path);
     return 0;
 }
 
-static void simulateKeyPress(Display *disp, KeySym keysym, int modmask)
+static void handleRequest(crikey* ck, int fd)
 {
-    KeyCode keycode = 0;
-
-    keycode = XKeysymToKeycode(disp, keysym);
-    if (keycode == 0) {
-        printf("crikey: Can't simulate keysym %ld: no keycode\n", keysym);
+    static char* buf = 0;
+    static size_t bufsize = 0;
+    static const char** strings = 0;
+    static int maxstrings = 0;
+    size_t len = 0;
+    ssize_t n;
+    char* s;
+    int nstrings = 0, ret;
+    char status;
+
+    for (;;) {
+        if (len + 1 >= bufsize) {
+            bufsize = bufsize ? bufsize * 2 : 4096;
+            buf = realloc(buf, bufsize);
+            if (!buf) {
+                printf("crikey: Out of memory\n");
+                exit(1);
+            }
+        }
+        n = read(fd, buf + len, bufsize - len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    buf[len] = '\0';
+    if (n < 0) {
+        perror("crikey: reading request");
         return;
     }
-
     if (Debug)
-        printf("keysym is %ld, keycode is %d, modmask is 0x%x\n",
-               keysym, keycode, modmask);
-
-    if (UseXTest) {
-        static KeyCode shiftKeycode = 0;
-        static KeyCode ctrlKeycode = 0;
-        static KeyCode altKeycode = 0;
-        static KeyCode metaKeycode = 0;
-
-        if (Debug)
-            printf("XTest wth mask = 0x%x\n", modmask);
-        XTestGrabControl(disp, True);
-
-#define FAKE_KEY(dpy,k,p,dl) { \
-            if (Debug) \
-                printf("Calling XTestFakeKeyEvent(%p, %d, %d, %d)\n", \
-                       dpy, k, p, dl); \
-            XTestFakeKeyEvent(dpy, k, p, dl); \
+        printf("Request of %lu bytes\n", (unsigned long)len);
+
+    for (s = buf; s < buf + len; s += strlen(s) + 1) {
+        if (nstrings >= maxstrings) {
+            maxstrings = maxstrings ? maxstrings * 2 : 64;
+            strings = realloc(strings, maxstrings * sizeof *strings);
+            if (!strings) {
+                printf("crikey: Out of memory\n");
+                exit(1);
+            }
         }
+        strings[nstrings++] = s;
+    }
+    crikey_poll(ck);
+    ret = crikey_send_batch(ck, strings, nstrings);
+    status = ret < 0 ? 1 : ret > 0 ? 2 : 0;
 
-        /* Handle modifier key presses */
-        if (modmask & ShiftMask) {
-            if (shiftKeycode == 0) {
-                shiftKeycode = XKeysymToKeycode(disp, XK_Shift_L);
-                if (Debug)
-                    printf("Keycode for shift is %d\n", shiftKeycode);
-            }
-            FAKE_KEY(disp, shiftKeycode, True, 0);   /* shift press */
+    if (write(fd, &status, 1) != 1 && Debug)
+        perror("crikey: answering request");
+}
+
+static int runDaemon(crikey* ck, char* path)
+{
+    struct sockaddr_un addr;
+    int sock, fd, xfd;
+    fd_set fds;
+
+    if (socketAddr(&addr, path) < 0)
+        return 1;
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("crikey: socket");
+        return 1;
+    }
+    /* Anyone who can connect can type into your windows */
+    umask(077);
+    unlink(path);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof addr) < 0
+        || listen(sock, 16) < 0) {
+        perror(path);
+        return 1;
+    }
+    if (Debug)
+        printf("Listening on %s\n", path);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    xfd = crikey_fd(ck);
+    while (!Quit) {
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        if (xfd >= 0)
+            FD_SET(xfd, &fds);
+        if (select((sock > xfd ? sock : xfd) + 1, &fds, 0, 0, 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("crikey: select");
+            break;
         }
-        if (modmask & ControlMask) {
-            if (ctrlKeycode == 0) {
-                ctrlKeycode = XKeysymToKeycode(disp, XK_Control_L);
-                if (Debug)
-                    printf("Keycode for ctrl is %d\n", ctrlKeycode);
-            }
-            FAKE_KEY(disp, ctrlKeycode, True, 0);    /* ctrl press */
+        /* Keep up with map and focus changes between requests */
+        if (xfd >= 0 && FD_ISSET(xfd, &fds))
+            crikey_poll(ck);
+        if (FD_ISSET(sock, &fds)) {
+            fd = accept(sock, 0, 0);
+            if (fd < 0)
+                continue;
+            handleRequest(ck, fd);
+            close(fd);
         }
+    }
 
-        if (modmask & Mod1Mask) {
-            if (altKeycode == 0) {
-                altKeycode = XKeysymToKeycode(disp, XK_Alt_L);
-                if (Debug)
-                    printf("Keycode for alt is %d\n", altKeycode);
-            }
-            FAKE_KEY(disp, altKeycode, True, 0);     /* alt press */
-        }
+    close(sock);
+    unlink(path);
+    return 0;
+}
 
-        if (modmask & Mod4Mask) {
-            if (metaKeycode == 0) {
-                metaKeycode = XKeysymToKeycode(disp, XK_Super_L);
-                if (Debug)
-                    printf("Keycode for meta/windows is %d\n", metaKeycode);
-            }
-            FAKE_KEY(disp, metaKeycode, True, 0);    /* win press */
-        }
+/* Send the arguments (or stdin) to a running daemon and wait for it.
+ * Returns the daemon's status.
+ */
+static int runClient(char* path, int argc, char** argv)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    char buf[BUFSIZE];
+    int sock, i;
+    ssize_t n;
+    char status;
+
+    if (socketAddr(&addr, path) < 0)
+        return 1;
+    /* The strings may be passwords: only give them to our own daemon,
+     * not to a socket someone else left in /tmp. /tmp is sticky, so
+     * nobody else can replace ours once we've looked at it.
+     */
+    if (lstat(path, &st) < 0) {
+        printf("crikey: Can't connect to daemon at %s\n", path);
+        return 1;
+    }
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+        printf("crikey: %s isn't our daemon's socket\n", path);
+        return 1;
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof addr) < 0) {
+        printf("crikey: Can't connect to daemon at %s\n", path);
+        return 1;
+    }
 
-        FAKE_KEY(disp, keycode, True, 0);            /* key press */
-        FAKE_KEY(disp, keycode, False, 0);           /* key release */
-
-        /* Handle modifier key releases */
-        if (modmask & Mod4Mask)
-            FAKE_KEY(disp, metaKeycode, False, 0);   /* win rel */
-        if (modmask & Mod1Mask)
-            FAKE_KEY(disp, altKeycode, False, 0);    /* alt rel */
-        if (modmask & ControlMask)
-            FAKE_KEY(disp, ctrlKeycode, False, 0);   /* ctrl rel */
-        if (modmask & ShiftMask)
-            FAKE_KEY(disp, shiftKeycode, False, 0);  /* shift rel */
-
-        XSync(disp, False);
-        XTestGrabControl(disp, False);
+    if (UseStdin) {
+        while ((n = read(0, buf, sizeof buf)) > 0)
+            if (write(sock, buf, n) != n)
+                break;
     }
     else {
-        /* Use XSendEvent instead of XTest */
-        XKeyEvent kevent;
-        Window focuswin;
-
-        /* Crikey used to get the focused window and send events
-         * directly there. But then you can't send commands to your
-         * window manager, like alt-tab. Sending to the root window
-         * gives the window manager a chance to intercept first.
-         */
-        if (UseRootWin) {
-            if (Debug) printf("Sending to root window\n");
-            focuswin = DefaultRootWindow(disp);
-        }
-        else {
-            int revert_to;
-            XGetInputFocus(disp, &focuswin, &revert_to);
-            if (focuswin == 0) {
-                printf("No focused window!\n");
-                return;
-            }
+        for (i = 1; i < argc; ++i) {
+            size_t len = strlen(argv[i]) + 1;
+            if (write(sock, argv[i], len) != len)
+                break;
         }
+    }
+    shutdown(sock, SHUT_WR);
 
-        kevent.display = disp;
-        kevent.root = DefaultRootWindow(disp);
-        kevent.window = focuswin;
-        kevent.subwindow = None;
-        kevent.time = CurrentTime;
-        kevent.x = 1;
-        kevent.y = 1;
-        kevent.x_root = 1;
-        kevent.y_root = 1;
-        kevent.same_screen = TRUE;
-        kevent.type = KeyPress;
-        kevent.keycode = keycode;
-        kevent.state = modmask;
-        if (Debug)
-            printf("Sending an event with keycode = %d, modifier mask 0x%x\n",
-                   kevent.keycode, kevent.state);
-
-        XSendEvent(disp, focuswin, TRUE, KeyPressMask, (XEvent *)&kevent);
-        /* Wonder if we might ever need the key release --
-         * but in some contexts, that actually gets interpreted
-         * as another key press!
-        XSendEvent(disp, focuswin, TRUE, KeyReleaseMask, (XEvent *)&kevent);
-         */
-        XSync(disp, False);
+    if (read(sock, &status, 1) != 1) {
+        printf("crikey: Daemon didn't answer\n");
+        close(sock);
+        return 1;
     }
+    close(sock);
+    if (status == 1)
+        printf("crikey: The daemon stopped before the end\n");
+    else if (status == 2)
+        printf("crikey: Some keys couldn't be typed\n");
+    return status;
 }
 
-#define MAXSYMSIZE 32
+/* --record file: until interrupted */
+static int runRecord(crikey* ck, char* filename)
+{
+    printf("Recording to %s; interrupt to stop\n", filename);
+    fflush(stdout);
+    return crikey_record(ck, filename, &Quit) < 0 ? 1 : 0;
+}
 
-static void simulateKeyPressForString(Display* disp, char* s)
+static int playFile(crikey* ck, char* filename)
 {
-    KeySym keysym;
-    char buf[2];
-    char sym[MAXSYMSIZE];
-    int i, n;
-    int modmask = 0;
-    int cont;
-
-    while (*s)
-    {
-        cont = 0;
-        keysym = 0;
-        if (*s == '\\' && *(s+1) != '\0') {
-            switch (*(++s))
-            {
-              case '\\':
-                  buf[0] = '\\';
-                  break;
-              case 'S':
-                  modmask |= ShiftMask;
-                  cont = 1;
-                  break;
-              case 'C':
-                  modmask |= ControlMask;
-                  cont = 1;
-                  if (Debug) printf("C- control char\n");
-                  break;
-              case 'A':
-                  modmask |= Mod1Mask;
-                  cont = 1;
-                  break;
-              case 'M':
-              case 'W':
-                  modmask |= Mod4Mask;
-                  cont = 1;
-                  break;
-              case 'n':
-                  buf[0] = '\n';
-                  break;
-              case 'r':
-                  buf[0] = '\r';
-                  break;
-              case 't':
-                  buf[0] = '\t';
-                  break;
-              case 'b':
-                  buf[0] = '\010';
-                  break;
-              case 'd':
-                  buf[0] = '\177';
-                  break;
-              case 'e':
-                  buf[0] = '\27';
-                  break;
-              case '0':  case '1':  case '2':  case '3':  case '4':
-              case '5':  case '6':  case '7':  case '8':  case '9':
-                  for (i = n = 0; isdigit(s[0]); ++s)
-                      n = n * 10 + s[0] - '0';
-                  buf[0] = n;
-                  if (Debug) printf("Numeric character %d\n", n);
-                  --s;
-                  break;
-              case '(':
-                  /* parse a symbolic name */
-                  for (i=0, ++s;
-                       i < MAXSYMSIZE-1 && s[0] != 0
-                       && !(s[0] == '\\' && s[1] == ')');
-                       ++i, ++s) {
-                      sym[i] = *s;
-                  }
-
-                  /* keysym is in sym; parse it now */
-                  sym[i] = '\0';
-                  keysym = XStringToKeysym(sym);
-                  if (Debug) {
-                      printf("Found symbol '%s' ...", sym);
-                      printf("which has keysym %lu ", keysym);
-                      printf("and keycode %d\n",
-                             (unsigned)XKeysymToKeycode(disp,
-                                                        XStringToKeysym(sym)));
-                  }
-                  buf[0] = 0;
-
-                  /* Some symbols, like >, modmask needs to be ShiftMask.
-                   * XConvertCase can't tell us this -- it says both
-                   * the upper and lower forms of > are 62.
-                   * XStringToKeysym doesn't tell us either,
-                   * nor the char string we could use for isshift().
-                   * Empirically, though, converting the keysym to char
-                   * works and lets us look it up in isshift.
-                   * What a mess!
-                   */
-                  if (isshift((char*)&keysym))
-                      modmask |= ShiftMask;
-                  ++s;
-                  break;
-              default:
-                  --s;
-                  buf[0] = '\\';
-                  break;
-            }
+    crikey_stats stats;
+    FILE* fp = fopen(filename, "rb");
+
+    if (!fp) {
+        perror(filename);
+        return 1;
+    }
+    if (crikey_play(ck, fp, filename) < 0)
+        return 1;
+    crikey_get_stats(ck, &stats);
+    return stats.failed ? 2 : 0;
+}
+
+/* Type the command line arguments, or the input file, or stdin.
+ * Returns how many keys couldn't be typed, or -1.
+ */
+static int sendInput(crikey* ck, int argc, char** argv, char* input_file)
+{
+    if (input_file)
+        return crikey_send_file(ck, input_file);
+    if (UseStdin)
+        return crikey_send_fd(ck, 0);
+    return crikey_send_batch(ck, (const char* const*)argv + 1, argc - 1);
+}
+
+/*
+ * Fan-out (--display a,b,c): the input is parsed once, against the
+ * first display's keyboard map, into a compiled program in memory.
+ * Then there's a child process per display, all sending at once;
+ * each plays the program like --play, looking keysyms up again if
+ * its keyboard map is different.
+ */
+static int playOnDisplay(char* name, char* prog, size_t proglen,
+                         char* play_file, const crikey_options* opts)
+{
+    crikey* ck;
+    crikey_stats stats;
+    FILE* fp;
+    long long start = nowNsec();
+    int ret;
+
+    ck = crikey_open(name, opts);
+    if (!ck)
+        return 1;
+    fp = prog ? fmemopen(prog, proglen, "rb") : fopen(play_file, "rb");
+    if (!fp) {
+        perror(play_file ? play_file : name);
+        crikey_close(ck);
+        return 1;
+    }
+    ret = crikey_play(ck, fp, play_file ? play_file : name) < 0 ? 1 : 0;
+    crikey_get_stats(ck, &stats);
+    crikey_close(ck);
+    if (ret == 0 && stats.failed)
+        ret = 2;
+    printf("crikey: %s: %lu key events in %.1f ms\n",
+           name, stats.keys, (nowNsec() - start) / 1e6);
+    return ret;
+}
+
+static int fanOut(char* list, char* play_file, char* input_file,
+                  int argc, char** argv, const crikey_options* opts,
+                  int show_stats)
+{
+    crikey_options childopts = *opts;
+    char** names = 0;
+    pid_t* pids = 0;
+    char* prog = 0;
+    size_t proglen = 0;
+    int ndisp = 1, nstarted = 0, nfailed = 0;
+    int i, status, ret = 1;
+    long long start;
+    pid_t pid;
+    char* cp;
+
+    for (cp = list; *cp; ++cp)
+        if (*cp == ',')
+            ++ndisp;
+    names = malloc(ndisp * sizeof *names);
+    pids = calloc(ndisp, sizeof *pids);
+    if (!names || !pids) {
+        printf("crikey: Out of memory\n");
+        goto done;
+    }
+    for (ndisp = 0, cp = strtok(list, ","); cp; cp = strtok(0, ","))
+        names[ndisp++] = cp;
+    if (ndisp == 0) {
+        printf("crikey: No displays in %s\n", list);
+        goto done;
+    }
+
+    if (!play_file) {
+        crikey* ck = crikey_open(names[0], opts);
+        FILE* fp;
+        int sent;
+
+        if (!ck)
+            goto done;
+        fp = open_memstream(&prog, &proglen);
+        if (!fp) {
+            perror("open_memstream");
+            crikey_close(ck);
+            goto done;
         }
-        else if (s[0] == '^' && s[1] != '\0') {
-            if (s[1] == '^') {
-                buf[0] = '^';
-                ++s;
-            }
-            else if (isalpha(s[1])) {
-                /* Control character: send the letter along with ControlMask */
-                if (Debug) printf("Control character\n");
-                modmask |= ControlMask;
-                if (isupper(s[1]))
-                    buf[0] = s[1] - 'A' + 'a';
-                else
-                    buf[0] = s[1];
-                if (Debug) printf("Control character ^%c = %d\n", s[1], buf[0]);
-                ++s;
-            }
-            else
-                buf[0] = '^';
+        /* Writing to a memory stream only fails for lack of memory */
+        if (crikey_compile(ck, fp) != 0) {
+            printf("crikey: Out of memory\n");
+            crikey_close(ck);
+            fclose(fp);
+            goto done;
         }
-        else {
-            if (Debug) printf("character '%c'\n", buf[0]);
-            buf[0] = *s;
+        sent = sendInput(ck, argc, argv, input_file);
+        crikey_compile(ck, 0);
+        if (show_stats)
+            crikey_print_stats(ck);
+        crikey_close(ck);
+        if (fclose(fp) != 0) {
+            printf("crikey: Out of memory\n");
+            goto done;
         }
+        /* Don't play half a program */
+        if (sent < 0)
+            goto done;
+        if (Debug)
+            printf("Compiled %lu bytes for %d displays\n",
+                   (unsigned long)proglen, ndisp);
+    }
 
-        /* If cont is set, then we've only gotten modifiers
-         * and need to loop around again to get the actual character.
-         */
-        if (cont) {
-            ++s;
+    /* Only the parse goes in the trace */
+    childopts.trace_file = 0;
+
+    /* Don't let the children write out our buffers a second time */
+    fflush(0);
+    start = nowNsec();
+    for (i = 0; i < ndisp; ++i) {
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            printf("crikey: %s failed\n", names[i]);
+            ++nfailed;
             continue;
         }
-
-        if (!keysym && buf[0] != 0) {
-            buf[1] = '\0';
-
-            /* Evil special cases */
-
-            /* Ctrl-D has to be sent as a control and a d,
-             * not an EOF character.
-             */
-#if 0
-            if (buf[0] == 4) {   /* ctrl-d */
-                modmask |= ControlMask;
-                buf[0] = 'd';
-            }
-            else if (buf[0] == 12) {   /* ctrl-l */
-                modmask |= ControlMask;
-                buf[0] = 'l';
-            }
-#endif
-
-            /* For some reason, '<' needs special treatment.
-             * XStringToKeysym("less") returns 60, and
-             * XKeysymToKeycode(60) returns keycode 94
-             * but generating an event with keycode 94 will send a '>'
-             * The keysym needs to be 44 to get a keycode of 59 to send a '<'.
-            if (keysym == 60) {
-            */
-            if (buf[0] == '<') {
-                keysym = 44;
-                //keycode = 59;
-                //modmask |= ShiftMask;       /* may not need this */
-                if (Debug) printf("Special case for >\n");
-            }
-            else
-                keysym = XStringToKeysym(buf);
-
-            if (keysym == NoSymbol) {
-                int i;
-                if (Debug) printf("keysym for char 0x%x was 0\n", buf[0]);
-                for (i=0;
-                     i < ((sizeof NonPrintables) / (sizeof *NonPrintables));
-                     ++i) {
-                    if (*buf == NonPrintables[i].ch) {
-                        keysym = XStringToKeysym(NonPrintables[i].keySymName);
-                        if (Debug)
-                            printf("Nonprintable: name = %s, keysym = %ld\n",
-                                   NonPrintables[i].keySymName, keysym);
-                        break;
-                    }
-                }
-            }
+        if (pid == 0) {
+            status = playOnDisplay(names[i], prog, proglen, play_file,
+                                   &childopts);
+            fflush(stdout);
+            _exit(status);
         }
+        pids[i] = pid;
+        ++nstarted;
+    }
 
-        if (isshift(buf))
-            modmask |= ShiftMask;
-
-        if (keysym)
-            simulateKeyPress(disp, keysym, modmask);
-        else if (Debug) {
-            printf("crikey: Can't simulate key '%s'\n", buf);
+    while (nstarted > 0) {
+        pid = wait(&status);
+        if (pid < 0 && errno == EINTR) {
+            /* Pass it on, and wait for them to empty their spare
+             * keycodes
+             */
+            for (i = 0; i < ndisp; ++i)
+                if (pids[i] > 0)
+                    kill(pids[i], SIGTERM);
+            continue;
         }
-
-        ++s;
-        modmask = 0;
+        if (pid < 0)
+            break;
+        for (i = 0; i < ndisp; ++i)
+            if (pids[i] == pid)
+                break;
+        if (i >= ndisp)
+            continue;
+        pids[i] = 0;
+        --nstarted;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            continue;
+        ++nfailed;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 2)
+            printf("crikey: %s: some keys couldn't be typed\n", names[i]);
+        else
+            printf("crikey: %s failed\n", names[i]);
     }
+    if (Debug || nfailed)
+        printf("crikey: %d displays in %.1f ms, %d failed\n",
+               ndisp, (nowNsec() - start) / 1e6, nfailed);
+    ret = nfailed ? 1 : 0;
+
+done:
+    free(prog);
+    free(names);
+    free(pids);
+    return ret;
 }
 
 void Usage(void)
 {
     printf("crikey! version %s\n", VERSION);
     printf("\tby Akkana Peck, http://shallowsky.com/software/crikey\n\n");
-    printf("Usage: crikey [-itxr] [-sS sleeptime] string...\n");
+    printf("Usage: crikey [-itxXurn] [-sS sleeptime] [-b batchsize] [-f file] [-k name] string...\n");
     printf("\t-s seconds: sleep time before sending\n");
     printf("\t-S milliseconds: sleep time before sending\n");
     printf("\t-i: Interactive (read input from stdin)\n");
+    printf("\t-f file: Read input from file\n");
+    printf("\t-k name: Type the snippet called name\n");
     printf("\t-t: Use XTest to send events (default)\n");
     printf("\t-x: Use XSendEvent to send events\n");
+    printf("\t-X: Use XTest through XCB, checking errors once per batch\n");
+    printf("\t-u: Use a uinput virtual keyboard (no X needed)\n");
+    printf("\t-U file: Write uinput events to file instead (- for stdout)\n");
+    printf("\t-n: Send nothing, just parse (to time it with --stats)\n");
     printf("\t-r: Send events to root window (only with XSendEvent)\n");
+    printf("\t-w ids: Send to each of these windows (comma separated)\n");
+    printf("\t-W pattern: Send to each window whose title or class matches\n");
+    printf("\t-b keys: Send at most this many keys per server round trip\n");
+    printf("\t-p rate: Send this many keys per second\n");
+    printf("\t-a: Adapt the rate to how fast the server keeps up\n");
+    printf("\t--compile file: Save the events to file instead of sending\n");
+    printf("\t--play file: Send events saved with --compile or --record\n");
+    printf("\t--record file: Save real key events to file until interrupted\n");
+    printf("\t--speed factor: --play this many times faster (0: no waits)\n");
+    printf("\t--paste sel: Paste plain text through clipboard or primary\n");
+    printf("\t--paste-keys keys: The keys that paste (default \\Cv)\n");
+    printf("\t--wait-timeout ms: Longest a \\(wait:...\\) waits (10000)\n");
+    printf("\t--daemon: Stay running and type what clients send\n");
+    printf("\t--client: Send the string to a running daemon\n");
+    printf("\t--socket path: Socket for --daemon and --client\n");
+    printf("\t--stats: Print counts and timings when done\n");
+    printf("\t--trace file: Write a timeline of events (Chrome trace format)\n");
+    printf("\t--display list: Send to these displays (comma separated) at once\n");
+    printf("\t--snippets file: Snippet library for -k (~/.crikey-snippets)\n");
     printf("\t-l: Show long (more detailed) help\n");
     printf("\t-d: Show debug messages\n");
     exit(0);
@@ -500,7 +537,13 @@ void LongHelp(void)
     printf("Modifier keys: \\S for shift, \\C control, \\A alt,\n");
     printf("  \\M or \\W for the \"Windows\" key.\n");
     printf("Special symbols: \\(Return\\) (defined in /usr/include/X11/keysymdef.h)\n");
-    printf("  but only those defined on your keyboard will likely work.)\n");
+    printf("Repeats: \\(BackSpace*500\\) or \\t{20} types a key 500 or 20 times;\n");
+    printf("  a count in braces works after any escaped or modified key.\n");
+    printf("Waits: \\(sleep:250\\) waits 250 ms; \\(wait:focus\\) waits for the\n");
+    printf("  focus to move; \\(wait:window:Title\\) waits for a window with Title\n");
+    printf("  in its title. If a wait times out, the rest isn't typed.\n");
+    printf("UTF-8 text is typed as-is; characters that aren't on your keyboard\n");
+    printf("  are temporarily mapped onto unused keycodes.\n");
     printf("\n");
     printf("Examples:\n");
     printf("  crikey '\\CL': print a control-L (clear the screen).\n");
@@ -508,6 +551,8 @@ void LongHelp(void)
     printf("  crikey \"echo foo \\(greater\\) /dev/null\"\n");
     printf("  crikey \"wall\\nHello, world\\n^D\"\n");
     printf("  crikey '\\(Up\\)': send an up-arrow.\n");
+    printf("  crikey '^o\\(wait:window:Open\\)notes.txt\\n':\n");
+    printf("    Open a file as soon as the Open dialog is up.\n");
     printf("  crikey -t \"\\A\\t\":\n");
     printf("    Should change the active window (in most window managers).\n");
     printf("    This needs XTest (-t) and doesn't work with XSendEvent.\n");
@@ -519,40 +564,162 @@ void LongHelp(void)
     exit(0);
 }
 
+/* Get the number after a flag, either -s5 or -s 5 */
+static int numericArg(int* argcp, char*** argvp)
+{
+    char** argv = *argvp;
+    int n;
+
+    if (isdigit(argv[1][2]))
+        return atoi(argv[1]+2);
+    if (*argcp > 2 && isdigit(argv[2][0])) {
+        n = atoi(argv[2]);
+        --*argcp;
+        ++*argvp;
+        return n;
+    }
+    return -1;
+}
+
+/* Get the argument after a long option, e.g. --play file */
+static char* stringArg(int* argcp, char*** argvp)
+{
+    if (*argcp < 3) {
+        printf("%s needs an argument\n", (*argvp)[1]);
+        Usage();
+    }
+    --*argcp;
+    ++*argvp;
+    return (*argvp)[1];
+}
+
+/* Parse a list of window ids for -w: 0x1e00005,0x2200007 */
+static void windowList(char* list, crikey_options* opts)
+{
+    unsigned long* ids;
+    char* p;
+    int n = 1;
+
+    for (p = list; *p; ++p)
+        if (*p == ',')
+            ++n;
+    ids = malloc(n * sizeof *ids);
+    if (!ids) {
+        printf("crikey: Out of memory\n");
+        exit(1);
+    }
+    for (n = 0, p = list; *p; ++n) {
+        ids[n] = strtoul(p, &p, 0);
+        if (!ids[n] || (*p && *p != ',')) {
+            printf("Bad window id in %s\n", list);
+            Usage();
+        }
+        if (*p)
+            ++p;
+    }
+    opts->windows = ids;
+    opts->num_windows = n;
+}
+
 int main(int argc, char** argv)
 {
-    int i;
-    Display* disp = XOpenDisplay(0);
-    int op, ev, er;
+    crikey_options opts;
+    crikey* ck;
     int sleeptime = 0;
     int use_usleep = FALSE;
+    char* compile_file = 0;
+    char* play_file = 0;
+    char* record_file = 0;
+    char* socket_path = 0;
+    char* input_file = 0;
+    char* display_list = 0;
+    char* snippet = 0;
+    char* snippet_file = 0;
+    int daemon_mode = 0;
+    int client_mode = 0;
+    int show_stats = 0;
+    int ret = 0;
+
+    crikey_default_options(&opts);
 
     /* -- means "ignore all flags after this one"
      * so crikey can handle strings starting with a dash.
      */
     while (argc > 1 && argv[1][0] == '-') {
         if (argv[1][1] == '-') {
+            if (argv[1][2] == '\0') {
+                --argc;
+                ++argv;
+                break;
+            }
+            if (!strcmp(argv[1], "--compile"))
+                compile_file = stringArg(&argc, &argv);
+            else if (!strcmp(argv[1], "--play"))
+                play_file = stringArg(&argc, &argv);
+            else if (!strcmp(argv[1], "--record"))
+                record_file = stringArg(&argc, &argv);
+            else if (!strcmp(argv[1], "--speed")) {
+                char* end;
+
+                opts.speed = strtod(stringArg(&argc, &argv), &end);
+                if (*end || opts.speed < 0) {
+                    printf("What speed?\n");
+                    Usage();
+                }
+            }
+            else if (!strcmp(argv[1], "--paste")) {
+                char* sel = stringArg(&argc, &argv);
+
+                if (!strcmp(sel, "clipboard"))
+                    opts.paste = CRIKEY_CLIPBOARD;
+                else if (!strcmp(sel, "primary"))
+                    opts.paste = CRIKEY_PRIMARY;
+                else {
+                    printf("Paste through clipboard or primary?\n");
+                    Usage();
+                }
+            }
+            else if (!strcmp(argv[1], "--paste-keys"))
+                opts.paste_keys = stringArg(&argc, &argv);
+            else if (!strcmp(argv[1], "--wait-timeout")) {
+                char* end;
+
+                opts.wait_timeout = strtol(stringArg(&argc, &argv), &end, 10);
+                if (*end || opts.wait_timeout <= 0) {
+                    printf("How many milliseconds?\n");
+                    Usage();
+                }
+            }
+            else if (!strcmp(argv[1], "--daemon"))
+                daemon_mode = 1;
+            else if (!strcmp(argv[1], "--client"))
+                client_mode = 1;
+            else if (!strcmp(argv[1], "--socket"))
+                socket_path = stringArg(&argc, &argv);
+            else if (!strcmp(argv[1], "--stats"))
+                show_stats = opts.stats = 1;
+            else if (!strcmp(argv[1], "--trace"))
+                opts.trace_file = stringArg(&argc, &argv);
+            else if (!strcmp(argv[1], "--display"))
+                display_list = stringArg(&argc, &argv);
+            else if (!strcmp(argv[1], "--snippets"))
+                snippet_file = stringArg(&argc, &argv);
+            else
+                Usage();
             --argc;
             ++argv;
-            break;
+            continue;
         }
 
         switch(argv[1][1]) {
           case 'd': // debug mode
-              Debug=1;
+              Debug = opts.debug = 1;
               break;
           case 'S':  // millisecond sleep
               use_usleep = TRUE;
           case 's':  // sleep
-              if (isdigit(argv[1][2])) {
-                  sleeptime = atoi(argv[1]+2);
-              }
-              else if (argc > 2 && isdigit(argv[2][0])) {
-                  sleeptime = atoi(argv[2]);
-                  --argc;
-                  ++argv;
-              }
-              else {
+              sleeptime = numericArg(&argc, &argv);
+              if (sleeptime < 0) {
                   printf("Sleep how long?\n");
                   Usage();
               }
@@ -566,19 +733,111 @@ int main(int argc, char** argv)
               break;
 
           case 'x':  // use XSendEvent, not XTest
-              UseXTest = 0;
+              opts.backend = CRIKEY_XSENDEVENT;
               break;
           case 't':  // use X Test extension if available.  Default: don't.
-              UseXTest = 1;
+              opts.backend = CRIKEY_XTEST;
+              break;
+          case 'u':  // no X: a uinput virtual keyboard
+              opts.backend = CRIKEY_UINPUT;
+              break;
+          case 'U':  // write uinput events to a file
+              opts.backend = CRIKEY_UINPUT;
+              if (argv[1][2])
+                  opts.uinput_file = argv[1] + 2;
+              else if (argc > 2) {
+                  opts.uinput_file = argv[2];
+                  --argc;
+                  ++argv;
+              }
+              else {
+                  printf("Write events to what file?\n");
+                  Usage();
+              }
+              break;
+          case 'n':  // parse, but send nothing
+              opts.backend = CRIKEY_NULL;
+              break;
+          case 'X':  // XTest through XCB
+              opts.backend = CRIKEY_XCB;
               break;
 
           case 'r':  // Send events to the root window, not the focused one.
                      // (only matters for XSendEvent)
-              UseRootWin = 1;
+              opts.root_window = 1;
+              break;
+          case 'b':  // batch size
+              opts.batch_size = numericArg(&argc, &argv);
+              if (opts.batch_size < 0) {
+                  printf("How many keys per batch?\n");
+                  Usage();
+              }
+              break;
+          case 'p':  // pace: keys per second
+              opts.rate = numericArg(&argc, &argv);
+              if (opts.rate <= 0) {
+                  printf("How many keys per second?\n");
+                  Usage();
+              }
+              break;
+          case 'a':  // adaptive pacing
+              opts.adaptive = 1;
               break;
           case 'i':  // take string from standard input
               UseStdin = 1;
               break;
+          case 'f':  // take string from a file
+              if (argv[1][2])
+                  input_file = argv[1] + 2;
+              else if (argc > 2) {
+                  input_file = argv[2];
+                  --argc;
+                  ++argv;
+              }
+              else {
+                  printf("Read from what file?\n");
+                  Usage();
+              }
+              break;
+          case 'w':  // send to these windows
+              if (argv[1][2])
+                  windowList(argv[1] + 2, &opts);
+              else if (argc > 2) {
+                  windowList(argv[2], &opts);
+                  --argc;
+                  ++argv;
+              }
+              else {
+                  printf("Which windows?\n");
+                  Usage();
+              }
+              break;
+          case 'W':  // send to windows whose title or class matches
+              if (argv[1][2])
+                  opts.window_match = argv[1] + 2;
+              else if (argc > 2) {
+                  opts.window_match = argv[2];
+                  --argc;
+                  ++argv;
+              }
+              else {
+                  printf("Match which windows?\n");
+                  Usage();
+              }
+              break;
+          case 'k':  // type a snippet from the library
+              if (argv[1][2])
+                  snippet = argv[1] + 2;
+              else if (argc > 2) {
+                  snippet = argv[2];
+                  --argc;
+                  ++argv;
+              }
+              else {
+                  printf("Which snippet?\n");
+                  Usage();
+              }
+              break;
           case 'l':
               LongHelp();
           default:
@@ -588,36 +847,80 @@ int main(int argc, char** argv)
         ++argv;
     }
 
-    /* Decide whether we can use the XTest extension */
-    if (UseXTest)
-        UseXTest = XQueryExtension(disp, "XTEST", &op, &ev, &er);
-    if (Debug) {
-        if (UseXTest)
-            printf("Using XTest Extension\n");
-        else
-            printf("Using XSendEvent\n");
+    if (!socket_path)
+        socket_path = socketPath();
+
+    /* A snippet is typed just as if it were the only argument */
+    if (snippet) {
+        static char* snippet_argv[3];
+
+        snippet_argv[0] = argv[0];
+        snippet_argv[1] = crikey_load_snippet(snippet_file, snippet);
+        if (!snippet_argv[1])
+            exit(1);
+        argc = 2;
+        argv = snippet_argv;
     }
 
-    if (!UseStdin) {
-        KeySym space_keysym = XStringToKeysym(" ");
-        for (i=1; i < argc; ++i) {
-            simulateKeyPressForString(disp, argv[i]);
-            if (i < argc-1)
-                simulateKeyPress(disp, space_keysym, 0);
+    /* The client never talks to the X server itself */
+    if (client_mode)
+        return runClient(socket_path, argc, argv);
+
+    if (record_file
+        && (opts.backend == CRIKEY_UINPUT || opts.backend == CRIKEY_NULL)) {
+        printf("crikey: --record needs an X server\n");
+        exit(1);
+    }
+
+    /* From here on there's a context, with spare keycodes to empty */
+    opts.stop = &Quit;
+    catchSignals();
+
+    if (display_list && strchr(display_list, ',')
+        && opts.backend != CRIKEY_UINPUT && opts.backend != CRIKEY_NULL) {
+        if (daemon_mode || compile_file || record_file) {
+            printf("crikey: --daemon, --compile and --record need a single display\n");
+            exit(1);
         }
+        return fanOut(display_list, play_file, input_file, argc, argv,
+                      &opts, show_stats);
     }
-    else {  /* use standard input ; this is highly inefficient */
-        char buffer[BUFSIZE];
-
-        do {
-            if (fgets(buffer, BUFSIZE, stdin) != 0) {
-                /* don't print empty strings */
-                if (strlen(buffer) > 0)
-                    simulateKeyPressForString(disp, buffer);
-                /* clear the string */
-                buffer[0] = '\0';
+
+    ck = crikey_open(display_list, &opts);
+    if (!ck)
+        exit(1);
+
+    if (daemon_mode)
+        ret = runDaemon(ck, socket_path);
+    else if (record_file)
+        ret = runRecord(ck, record_file);
+    else if (play_file)
+        ret = playFile(ck, play_file);
+    else {
+        FILE* out = 0;
+        int sent;
+
+        if (compile_file) {
+            out = fopen(compile_file, "wb");
+            if (!out || crikey_compile(ck, out) != 0) {
+                perror(compile_file);
+                crikey_close(ck);
+                exit(1);
             }
-        } while (!feof(stdin));
+        }
+        sent = sendInput(ck, argc, argv, input_file);
+        ret = sent < 0 ? 1 : sent > 0 ? 2 : 0;
+        if (out) {
+            crikey_compile(ck, 0);
+            if (fclose(out) != 0) {
+                perror(compile_file);
+                ret = 1;
+            }
+        }
     }
-    return 0;
+
+    if (show_stats)
+        crikey_print_stats(ck);
+    crikey_close(ck);
+    return ret;
 }
@@ -0,0 +1,160 @@
+/*
+ * libcrikey: type strings in crikey's syntax from your own program,
+ * without running crikey for each one.
+ *
+ * Copyright 2003-2009 by Akkana Peck, http://www.shallowsky.com/software/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * Everything lives in a crikey context: the display connection, the
+ * keymap cache, spare keycode bindings, pacing and options. Open one
+ * per display and keep it; sending a string is then just parsing and
+ * one flush. A context must only be used by one thread at a time.
+ *
+ * Nothing here exits: the functions that return an int return -1 on
+ * failure (including running out of memory), having printed why, and
+ * 0 or more otherwise.
+ *
+ *     crikey* ck = crikey_open(0, 0);
+ *     if (ck) {
+ *         crikey_send_string(ck, "Hello, world\\n");
+ *         crikey_close(ck);
+ *     }
+ */
+
+#ifndef CRIKEY_H
+#define CRIKEY_H
+
+#include <stdio.h>
+#include <signal.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* How to send the events */
+enum {
+    CRIKEY_XTEST,       /* the XTest extension (the default) */
+    CRIKEY_XCB,         /* XTest through XCB, errors checked per batch */
+    CRIKEY_XSENDEVENT,  /* XSendEvent to the focused (or root) window */
+    CRIKEY_UINPUT,      /* a uinput virtual keyboard; no X server */
+    CRIKEY_NULL         /* resolve keys on a US layout but send nothing,
+                         * to time the parser */
+};
+
+/* Selections to paste through */
+enum {
+    CRIKEY_NO_PASTE,    /* type everything */
+    CRIKEY_CLIPBOARD,
+    CRIKEY_PRIMARY
+};
+
+typedef struct {
+    int backend;                /* CRIKEY_XTEST etc. */
+    const char* uinput_file;    /* CRIKEY_UINPUT: write the events here
+                                 * instead ("-" for stdout) */
+    int root_window;            /* CRIKEY_XSENDEVENT: to the root window */
+    const unsigned long* windows;   /* send every key to each of these, */
+    int num_windows;
+    const char* window_match;   /* and to every window whose title or class
+                                 * matches this shell pattern; both mean
+                                 * CRIKEY_XSENDEVENT */
+    int batch_size;             /* max keys per flush; 0: a whole string */
+    int rate;                   /* keys per second; 0: as fast as we can */
+    int adaptive;               /* adjust rate to what the server keeps up with */
+    double speed;               /* crikey_play waits are divided by this;
+                                 * 0 means don't wait */
+    int paste;                  /* paste runs of plain text through this
+                                 * selection instead of typing them */
+    const char* paste_keys;     /* the keys that paste it, in crikey's
+                                 * syntax; 0 for \Cv */
+    int paste_min;              /* shorter runs are typed; 0 for 32 */
+    int wait_timeout;           /* how long \(wait:...\) waits, in ms;
+                                 * 0 for 10 seconds */
+    int stats;                  /* time each phase, for crikey_print_stats */
+    const char* trace_file;     /* write a Chrome trace of every phase and key */
+    int debug;                  /* print debug messages */
+    volatile sig_atomic_t* stop;    /* stop typing once this becomes
+                                     * nonzero (from a signal handler,
+                                     * say); 0 to always finish */
+} crikey_options;
+
+typedef struct {
+    unsigned long requests;     /* X requests made */
+    unsigned long roundtrips;   /* ones that waited for the server */
+    unsigned long lookups;      /* keymap cache lookups */
+    unsigned long namelookups;  /* XStringToKeysym calls */
+    unsigned long failed;       /* keysyms with no keycode */
+    unsigned long keys;         /* key events sent */
+    unsigned long eventhash;    /* CRIKEY_NULL: hash of the events that
+                                 * would have been sent */
+} crikey_stats;
+
+typedef struct crikey crikey;
+
+/* Fill in the defaults: XTest, no pacing, speed 1 */
+void crikey_default_options(crikey_options* opts);
+
+/* Open display (0 for $DISPLAY) with opts (0 for the defaults).
+ * Returns 0, having printed why, if it can't.
+ */
+crikey* crikey_open(const char* display, const crikey_options* opts);
+
+/* Empty any spare keycodes we borrowed and close the display */
+void crikey_close(crikey* ck);
+
+/* Type a string, or several with spaces between them, in one batch.
+ * These return the number of keys that couldn't be typed, so 0 means
+ * everything went out; or -1 if a \(wait:...\) timed out, memory
+ * ran out or *opts->stop was set, and the rest wasn't typed.
+ */
+int crikey_send_string(crikey* ck, const char* s);
+int crikey_send_batch(crikey* ck, const char* const* strings, int n);
+
+/* Type everything in a file, or read from fd until end of file,
+ * a piece at a time. -1 if the file can't be opened.
+ */
+int crikey_send_file(crikey* ck, const char* filename);
+int crikey_send_fd(crikey* ck, int fd);
+
+/* From now on write what would be sent to fp, as a crikey program,
+ * instead of sending it; crikey_compile(ck, 0) to stop. 0 or -1.
+ */
+int crikey_compile(crikey* ck, FILE* fp);
+
+/* Send a program made by crikey_compile or crikey_record.
+ * fp is closed afterwards; name is for messages. 0 or -1.
+ */
+int crikey_play(crikey* ck, FILE* fp, const char* name);
+
+/* Record real key events into filename, as a program,
+ * until *stop becomes nonzero (from a signal handler, a timer or
+ * another thread, say; it's looked at at least every 100 ms).
+ * 0 or -1.
+ */
+int crikey_record(crikey* ck, const char* filename,
+                  volatile sig_atomic_t* stop);
+
+/* The display connection, to select() on, or -1 for uinput;
+ * call crikey_poll when it's readable to keep up with keyboard
+ * map changes, focus changes and requests for pasted text.
+ */
+int crikey_fd(crikey* ck);
+void crikey_poll(crikey* ck);
+
+void crikey_get_stats(crikey* ck, crikey_stats* stats);
+void crikey_print_stats(crikey* ck);
+
+/* Look up a snippet in a library file (0 for ~/.crikey-snippets).
+ * Returns its text, malloced, or 0.
+ */
+char* crikey_load_snippet(const char* filename, const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CRIKEY_H */
@@ -0,0 +1,27 @@
+/*
+ * The hash of keysym names, shared by mkkeysyms, which builds the
+ * perfect hash table in keysyms.h, and libcrikey, which looks names
+ * up in it. FNV-1a, with a seed so each bucket can pick one that
+ * puts its names in free slots.
+ *
+ * Copyright 2003-2009 by Akkana Peck, http://www.shallowsky.com/software/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#ifndef KEYSYMHASH_H
+#define KEYSYMHASH_H
+
+static unsigned int keysymNameHash(const char* name, unsigned int seed)
+{
+    unsigned int hash = 2166136261u ^ (seed * 16777619u);
+
+    while (*name)
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    return hash;
+}
+
+#endif /* KEYSYMHASH_H */
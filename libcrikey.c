@@ -0,0 +1,3864 @@
+/*
+ * libcrikey: crikey's parser and event senders, for typing strings
+ * from inside another program. The crikey command is built on it.
+ *
+ * Copyright 2003-2009 by Akkana Peck, http://www.shallowsky.com/software/
+ * Other contributors:
+ *    Glen Smith, 2008
+ *    Efraim Feinstein, 2004
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <X11/Intrinsic.h> // for TRUE
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>     // for XConvertCase
+#include <X11/Xatom.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/record.h>
+#ifdef HAVE_XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xtest.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>     // for isdigit
+#include <string.h>    // for memset
+#include <limits.h>    // for PATH_MAX
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <sys/select.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/uinput.h>
+
+#include "crikey.h"
+#include "keysymhash.h"
+#include "keysyms.h"   // generated by mkkeysyms
+
+/* size of the buffer for reading from stdin */
+#define BUFSIZE 65536
+
+/*
+ * Everything crikey knows about one display lives in a struct crikey,
+ * so a program can keep several open (see crikey.h).
+ */
+
+/* X atoms for pasting and for finding windows */
+enum { A_CLIPBOARD, A_TARGETS, A_TIMESTAMP, A_UTF8_STRING, A_TEXT, A_INCR,
+       A_CRIKEY_TIME, A_NET_WM_NAME, A_WM_STATE, NUM_ATOMS };
+
+/* Where the time goes, for --stats and --trace */
+enum { PH_OTHER, PH_PARSE, PH_RESOLVE, PH_SUBMIT, PH_SYNC, PH_WAIT,
+       NUM_PHASES };
+
+/* Keymap cache entry: what it takes to type a keysym */
+typedef struct {
+    KeySym keysym;
+    KeyCode keycode;
+    unsigned char modmask;
+} KeymapEntry;
+
+/* Power of two, comfortably more than 4 columns * 256 keycodes */
+#define KEYMAP_HASH_SIZE 2048
+
+/* Modifiers we know how to press, in the order we press them.
+ * The keycodes, and the mask for ISO_Level3_Shift (AltGr),
+ * come from the keyboard map.
+ */
+typedef struct {
+    int mask;
+    KeySym keysym;
+    KeyCode keycode;
+} ModifierKey;
+
+static const ModifierKey DefaultModifiers[] = {
+    { ShiftMask,   XK_Shift_L,          0 },
+    { ControlMask, XK_Control_L,        0 },
+    { Mod1Mask,    XK_Alt_L,            0 },
+    { Mod4Mask,    XK_Super_L,          0 },
+    { 0,           XK_ISO_Level3_Shift, 0 },
+};
+#define NUM_MODIFIERS ((sizeof DefaultModifiers) / (sizeof *DefaultModifiers))
+#define LEVEL3 (NUM_MODIFIERS - 1)
+
+/* A keycode with nothing on it, which we can bind keysyms to */
+typedef struct {
+    KeyCode keycode;
+    KeySym keysym;          /* NoSymbol if free */
+    unsigned long used;     /* LRU clock */
+    unsigned long flush;    /* flushCount when it was last queued */
+    int dirty;              /* not sent to the server yet */
+} SpareKey;
+
+/*
+ * Key strokes waiting to be sent.  simulateKeyPress() only resolves the
+ * keycode and queues it; flushKeyPresses() sends the whole queue with
+ * one grab and one XSync, rather than a server round trip per key.
+ */
+enum { KS_KEY, KS_DELAY, KS_PRESS, KS_RELEASE, KS_WAIT };
+
+typedef struct {
+    unsigned char type;     /* KS_KEY, KS_DELAY, or a recorded
+                             * KS_PRESS or KS_RELEASE on its own;
+                             * KS_WAIT only in compiled programs */
+    KeyCode keycode;
+    unsigned char modmask;  /* modifiers to hold down with the key */
+    unsigned char mods;     /* the part of modmask the input asked for */
+    KeySym keysym;          /* what keycode was resolved from */
+    unsigned int arg;       /* KS_DELAY: milliseconds */
+} KeyStroke;
+
+struct crikey {
+    Display* disp;          /* 0 with uinput */
+
+    /* Options */
+    int useXTest;
+    int useXCB;             /* XTest through xcb, without waiting */
+    int useUinput;          /* no X at all: write to /dev/uinput or a file */
+    int useNull;            /* resolve keys but send nothing */
+    int useRootWin;
+    int batchSize;          /* max keys per flush; 0 means whole string */
+    int rate;               /* keys per second; 0 means as fast as we can */
+    int adaptive;           /* adjust rate to what the server keeps up with */
+    double speed;           /* play delays are divided by this; 0: none */
+    int waitTimeout;        /* milliseconds, for \(wait:...\) */
+    int fastPath;           /* plain text a run at a time; off with
+                             * $CRIKEY_NO_FAST_PATH, to check it */
+    int debug;
+
+    /* Instrumentation */
+    crikey_stats stats;
+    long long nsec[NUM_PHASES];
+    int timing;             /* keeping phase times */
+    int phase;
+    long long phaseStart;
+    FILE* traceFile;
+    long long traceStart;
+    const char* traceSep;
+
+    /* Keymap cache, and our copy of the keyboard map */
+    KeymapEntry keymapCache[KEYMAP_HASH_SIZE];
+    uint32_t keymapHash;    /* fingerprint of the map it came from */
+    ModifierKey modifiers[NUM_MODIFIERS];
+    KeySym* keymapSyms;
+    int minKeycode, maxKeycode, keysymsPer;
+
+    /* Plain ASCII characters, looked up the first time each is typed,
+     * so runs of plain text needn't go through the parser's switch.
+     */
+    KeySym charSyms[128];
+    KeyCode charKeys[128];      /* 0: not on the keyboard as is */
+    unsigned char charMods[128];
+    char charKnown[128];
+
+    /* Spare keycodes */
+    SpareKey spares[256];
+    int numSpares;
+    char isSpare[256];
+    unsigned long spareClock;
+    unsigned long flushCount;   /* batches sent so far */
+    int ownRemaps;              /* MappingNotifys we caused */
+    int sparesBound;            /* need emptying at close */
+
+    /* The queue, or where a compiled program goes instead */
+    KeyStroke* queue;
+    int queueLen;
+    int queueSize;
+    FILE* programOut;
+
+    /* uinput */
+    int uinputFd;
+    int uinputDevice;       /* it's a device we made, not a file */
+    struct input_event* uinputBuf;
+    int uinputLen;
+    int uinputSize;
+
+    /* Pacing */
+    struct timespec nextKeyTime;    /* zero: not pacing yet */
+    int adaptKeys;                  /* keys since the last adaptive sync */
+
+#ifdef HAVE_XCB
+    xcb_void_cookie_t* cookies;
+    int numCookies;
+    int cookiesSize;
+#endif
+
+    /* XSendEvent: the focused window, so we don't need an
+     * XGetInputFocus round trip per key. We ask for FocusChange events
+     * on it, and forget it as soon as it loses the focus.
+     */
+    Window focusWin;
+    Window* targets;        /* or every one of these (-w, -W) */
+    int numTargets;
+    int aborted;            /* a wait timed out, memory ran out or
+                             * the caller said stop: stop typing */
+    volatile sig_atomic_t* stop;    /* the caller's stop flag, or 0 */
+    XKeyEvent kevent;       /* everything but the key is the same */
+    int recordedState;      /* modifiers held down in a recording */
+
+    /* Pasting: the selection we paste through (None: type everything),
+     * and the chord that pastes it
+     */
+    Atom pasteSel;
+    Atom atoms[NUM_ATOMS];  /* None until we need them */
+    KeyStroke* chordKeys;
+    int numChordKeys;
+    int pasteMin;           /* shorter runs of text are typed */
+    Window pasteWin;        /* owns the selection */
+    char* pasteBuf;         /* what we're serving */
+    size_t pasteLen;
+    size_t pasteSize;
+    size_t pasteChunk;      /* the most one property change can carry */
+    Time pasteTime;         /* when we got the selection */
+    int pasteOwned;
+    int requested;          /* a client has asked for the text */
+    int pasteDone;          /* and has read all of it */
+
+    /* The transfer in progress, to one client at a time */
+    Window xferWin;
+    Atom xferProp;
+    Atom xferType;
+    size_t xferOff;         /* how much it has; past the end when done */
+};
+
+/*
+ * Instrumentation for --stats and --trace.  The counters are always
+ * kept, since they're only increments; phase times need a clock read
+ * at every phase change, so they're only kept when asked for.
+ * --trace writes each phase and each key event in Chrome's trace
+ * event format (load it in chrome://tracing or ui.perfetto.dev).
+ */
+static const char* PhaseNames[NUM_PHASES] = {
+    "other", "parse", "resolve", "submit", "sync", "wait"
+};
+
+static long long nowNsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Charge the time so far to the current phase and switch to another.
+ * Returns the old phase, so nested code can switch back to it.
+ */
+static int setPhase(crikey* ck, int phase)
+{
+    int old = ck->phase;
+    long long now;
+
+    if (!ck->timing || phase == old)
+        return old;
+    now = nowNsec();
+    ck->nsec[old] += now - ck->phaseStart;
+    if (ck->traceFile && old != PH_OTHER) {
+        fprintf(ck->traceFile, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                "\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                ck->traceSep, PhaseNames[old],
+                (ck->phaseStart - ck->traceStart) / 1e3,
+                (now - ck->phaseStart) / 1e3);
+        ck->traceSep = ",\n";
+    }
+    ck->phaseStart = now;
+    ck->phase = phase;
+    return old;
+}
+
+static void traceKey(crikey* ck, int keycode, int press)
+{
+    ++ck->stats.keys;
+    if (ck->traceFile) {
+        fprintf(ck->traceFile, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+                "\"pid\":1,\"tid\":1,\"ts\":%.3f,"
+                "\"args\":{\"keycode\":%d}}",
+                ck->traceSep, press ? "press" : "release",
+                (nowNsec() - ck->traceStart) / 1e3, keycode);
+        ck->traceSep = ",\n";
+    }
+}
+
+static int startStats(crikey* ck, const char* tracefile)
+{
+    if (tracefile) {
+        ck->traceFile = fopen(tracefile, "w");
+        if (!ck->traceFile) {
+            perror(tracefile);
+            return -1;
+        }
+    }
+    ck->timing = 1;
+    ck->traceStart = ck->phaseStart = nowNsec();
+    if (ck->traceFile) {
+        /* Where ts 0 is on CLOCK_MONOTONIC, to compare the key times
+         * with when a receiver got them (make bench does)
+         */
+        fprintf(ck->traceFile, "{\"traceEvents\":[\n"
+                "{\"name\":\"clock\",\"ph\":\"M\",\"pid\":1,"
+                "\"args\":{\"monotonic_us\":%.3f}}",
+                ck->traceStart / 1e3);
+        ck->traceSep = ",\n";
+    }
+    return 0;
+}
+
+static void endTrace(crikey* ck)
+{
+    setPhase(ck, PH_OTHER);
+    if (ck->traceFile) {
+        fprintf(ck->traceFile, "\n]}\n");
+        fclose(ck->traceFile);
+        ck->traceFile = 0;
+    }
+}
+
+void crikey_print_stats(crikey* ck)
+{
+    int i;
+
+    setPhase(ck, PH_OTHER);
+    printf("crikey: %lu key events, %lu X requests, %lu round trips\n",
+           ck->stats.keys, ck->stats.requests, ck->stats.roundtrips);
+    printf("  %lu keymap lookups, %lu XStringToKeysym calls,"
+           " %lu keysyms with no keycode\n",
+           ck->stats.lookups, ck->stats.namelookups, ck->stats.failed);
+    printf(" ");
+    for (i = 0; i < NUM_PHASES; ++i)
+        printf(" %s %.3f ms", PhaseNames[i], ck->nsec[i] / 1e6);
+    printf("\n");
+    if (ck->useNull)
+        printf("  event hash %08lx\n", ck->stats.eventhash);
+}
+
+/* A keysym from its name. Names in keysymdef.h are in the perfect
+ * hash table mkkeysyms generated; anything else (U20AC, 0x1008ff14,
+ * other vendors' keysyms) goes to XStringToKeysym, counted and timed.
+ */
+static KeySym stringToKeysym(crikey* ck, const char* name)
+{
+    unsigned int seed = KeysymSeeds[keysymNameHash(name, 0)
+                                    % KEYSYM_BUCKETS];
+    unsigned int slot = keysymNameHash(name, seed) & (KEYSYM_SLOTS - 1);
+    KeySym keysym;
+    int old;
+
+    if (KeysymSlots[slot].name
+        && !strcmp(KeysymNames + KeysymSlots[slot].name - 1, name))
+        return KeysymSlots[slot].keysym;
+
+    old = setPhase(ck, PH_RESOLVE);
+    keysym = XStringToKeysym(name);
+    ++ck->stats.namelookups;
+    setPhase(ck, old);
+    return keysym;
+}
+
+/* XSync, counted and timed */
+static void syncDisplay(crikey* ck)
+{
+    int old = setPhase(ck, PH_SYNC);
+
+    XSync(ck->disp, False);
+    ++ck->stats.requests;
+    ++ck->stats.roundtrips;
+    setPhase(ck, old);
+}
+
+/*
+ * Keymap cache: keysym -> (keycode, modifiers needed to get it),
+ * built once from XGetKeyboardMapping so we don't ask Xlib for every
+ * key, and so shifted symbols come out right on any layout.
+ * Rebuilt when the server sends MappingNotify.
+ */
+static unsigned int keysymHash(KeySym keysym)
+{
+    return (unsigned int)((keysym * 2654435761u) >> 7) & (KEYMAP_HASH_SIZE-1);
+}
+
+/* Returns the keycode for keysym (0 if it isn't on the keyboard),
+ * and adds the modifiers needed to type it to *modmask.
+ */
+static KeyCode lookupKeysym(crikey* ck, KeySym keysym, int* modmask)
+{
+    unsigned int h = keysymHash(keysym);
+    int old = setPhase(ck, PH_RESOLVE);
+    KeyCode keycode = 0;
+
+    ++ck->stats.lookups;
+    while (ck->keymapCache[h].keycode) {
+        if (ck->keymapCache[h].keysym == keysym) {
+            if (modmask)
+                *modmask |= ck->keymapCache[h].modmask;
+            keycode = ck->keymapCache[h].keycode;
+            break;
+        }
+        h = (h + 1) & (KEYMAP_HASH_SIZE-1);
+    }
+    setPhase(ck, old);
+    return keycode;
+}
+
+static void addKeysym(crikey* ck, KeySym keysym, KeyCode keycode, int modmask)
+{
+    unsigned int h = keysymHash(keysym);
+
+    while (ck->keymapCache[h].keycode) {
+        /* First binding wins, so unshifted keys are preferred */
+        if (ck->keymapCache[h].keysym == keysym)
+            return;
+        h = (h + 1) & (KEYMAP_HASH_SIZE-1);
+    }
+    ck->keymapCache[h].keysym = keysym;
+    ck->keymapCache[h].keycode = keycode;
+    ck->keymapCache[h].modmask = modmask;
+}
+
+/*
+ * Keysyms that aren't on the keyboard (most non-ASCII characters) are
+ * typed by binding them to a spare keycode, one with nothing mapped,
+ * using XChangeKeyboardMapping.  The bindings are kept as an LRU cache
+ * so a character that comes up again needs no new remap, and the
+ * remaps for a batch go out as one request just ahead of its key
+ * events.  At exit the spare keycodes are emptied again.
+ */
+/* Work out which keycodes are spare: those with nothing on them,
+ * and those we bound earlier that still have our keysym.
+ */
+static void findSpares(crikey* ck, KeySym* syms, int mincode, int maxcode,
+                       int per)
+{
+    SpareKey old[256];
+    int kc, i, j, n = 0;
+    int nold = ck->numSpares;
+
+    memcpy(old, ck->spares, nold * sizeof *old);
+    memset(ck->isSpare, 0, sizeof ck->isSpare);
+    for (kc = mincode; kc <= maxcode; ++kc) {
+        KeySym* row = syms + (kc - mincode) * per;
+        int empty = 1;
+
+        for (j = 0; j < per; ++j)
+            if (row[j] != NoSymbol)
+                empty = 0;
+        for (i = 0; i < nold; ++i)
+            if (old[i].keycode == kc)
+                break;
+        if (i < nold && (empty ? old[i].dirty : old[i].keysym == row[0]))
+            ck->spares[n++] = old[i];       /* still ours */
+        else if (empty) {
+            memset(&ck->spares[n], 0, sizeof ck->spares[n]);
+            ck->spares[n++].keycode = kc;
+        }
+        else
+            continue;
+        ck->isSpare[kc] = 1;
+    }
+    ck->numSpares = n;
+    if (ck->debug)
+        printf("%d spare keycodes\n", ck->numSpares);
+}
+
+/* Memory ran out: say so (once) and stop typing. The send functions
+ * then return -1, and crikey_open fails. A library mustn't exit.
+ */
+static void outOfMemory(crikey* ck)
+{
+    if (!ck->aborted)
+        printf("crikey: Out of memory\n");
+    ck->aborted = 1;
+}
+
+/* Has the caller set its stop flag (from a signal handler, say)?
+ * Then stop typing as if a wait had timed out, so it's soon back in
+ * control and can crikey_close, emptying the spare keycodes.
+ */
+static int stopping(crikey* ck)
+{
+    if (ck->stop && *ck->stop)
+        ck->aborted = 1;
+    return ck->aborted;
+}
+
+/* Build the cache from a keyboard map (per keysyms for each keycode
+ * from mincode to maxcode) and a modifier map (keypermod keycodes for
+ * each of the 8 modifiers), however we got them from the server.
+ */
+static void buildKeymapFrom(crikey* ck, const KeySym* map,
+                            int mincode, int maxcode, int per,
+                            const KeyCode* modkeys, int keypermod)
+{
+    /* Keymap columns we use: plain, shifted, AltGr, shifted AltGr */
+    static const int columns[] = { 0, 1, 4, 5 };
+    int kc, i, j;
+    KeySym* syms;
+
+    /* Keep our own copy, to change pieces of it later.
+     * Without one, the old cache stays.
+     */
+    syms = malloc((maxcode - mincode + 1) * per * sizeof *syms);
+    if (!syms) {
+        outOfMemory(ck);
+        return;
+    }
+    memcpy(syms, map, (maxcode - mincode + 1) * per * sizeof *syms);
+
+    memset(ck->keymapCache, 0, sizeof ck->keymapCache);
+    memset(ck->charKnown, 0, sizeof ck->charKnown);
+    for (i = 0; i < NUM_MODIFIERS; ++i)
+        ck->modifiers[i].keycode = 0;
+    findSpares(ck, syms, mincode, maxcode, per);
+
+    /* Which modifier bit, if any, does AltGr set? */
+    ck->modifiers[LEVEL3].mask = 0;
+    for (kc = mincode; kc <= maxcode && !ck->modifiers[LEVEL3].mask; ++kc) {
+        if (syms[(kc - mincode) * per] != XK_ISO_Level3_Shift)
+            continue;
+        for (i = 0; i < 8 * keypermod; ++i)
+            if (modkeys[i] == kc) {
+                ck->modifiers[LEVEL3].mask = 1 << (i / keypermod);
+                break;
+            }
+    }
+
+    for (j = 0; j < (sizeof columns) / (sizeof *columns); ++j) {
+        int col = columns[j];
+        int modmask = (col & 1) ? ShiftMask : 0;
+
+        /* Column 1 can come from column 0, below */
+        if (col >= per && col != 1)
+            break;
+        if (col >= 4) {
+            if (!ck->modifiers[LEVEL3].mask)
+                break;
+            modmask |= ck->modifiers[LEVEL3].mask;
+        }
+        for (kc = mincode; kc <= maxcode; ++kc) {
+            KeySym keysym = (col < per) ? syms[(kc - mincode) * per + col]
+                                        : NoSymbol;
+
+            /* A letter listed only in lowercase (as xmodmap maps
+             * often are) types its uppercase with Shift, by the core
+             * protocol's rules
+             */
+            if (col == 1 && keysym == NoSymbol) {
+                KeySym lower, upper;
+
+                XConvertCase(syms[(kc - mincode) * per], &lower, &upper);
+                if (upper != syms[(kc - mincode) * per])
+                    keysym = upper;
+            }
+            if (keysym != NoSymbol && !ck->isSpare[kc])
+                addKeysym(ck, keysym, kc, modmask);
+        }
+    }
+
+    /* FNV-1a over the map, so saved programs can tell if it changed.
+     * Our own spare bindings come and go, so they don't count.
+     */
+    ck->keymapHash = 2166136261u;
+    for (i = 0; i < (maxcode - mincode + 1) * per; ++i) {
+        if (!ck->isSpare[mincode + i / per])
+            ck->keymapHash = (ck->keymapHash ^ (uint32_t)syms[i]) * 16777619u;
+    }
+    ck->keymapHash = (ck->keymapHash ^ ck->modifiers[LEVEL3].mask) * 16777619u;
+
+    free(ck->keymapSyms);
+    ck->keymapSyms = syms;
+    ck->minKeycode = mincode;
+    ck->maxKeycode = maxcode;
+    ck->keysymsPer = per;
+
+    for (i = 0; i < NUM_MODIFIERS; ++i) {
+        ck->modifiers[i].keycode = lookupKeysym(ck, ck->modifiers[i].keysym,
+                                                0);
+        if (ck->debug)
+            printf("Keycode for modifier 0x%x is %d\n",
+                   ck->modifiers[i].mask, ck->modifiers[i].keycode);
+    }
+}
+
+static void buildKeymapCache(crikey* ck)
+{
+    int mincode, maxcode, per;
+    KeySym* syms;
+    XModifierKeymap* modmap;
+
+    XDisplayKeycodes(ck->disp, &mincode, &maxcode);
+    syms = XGetKeyboardMapping(ck->disp, mincode, maxcode - mincode + 1, &per);
+    if (!syms) {
+        printf("crikey: Can't get the keyboard mapping\n");
+        return;
+    }
+    modmap = XGetModifierMapping(ck->disp);
+    ck->stats.requests += 2;
+    ck->stats.roundtrips += 2;
+
+    buildKeymapFrom(ck, syms, mincode, maxcode, per,
+                    modmap->modifiermap, modmap->max_keypermod);
+    XFreeModifiermap(modmap);
+    XFree(syms);
+}
+
+#ifdef HAVE_XCB
+/*
+ * Startup for the XCB backend: ask for the XTEST extension, the keyboard
+ * map and the modifier map all at once, then collect the answers,
+ * so the three cost one round trip instead of three.
+ * Returns 0 if the server has no XTEST.
+ */
+static int buildKeymapCacheXCB(crikey* ck)
+{
+    xcb_connection_t* conn = XGetXCBConnection(ck->disp);
+    const xcb_setup_t* setup = xcb_get_setup(conn);
+    const xcb_query_extension_reply_t* xtest;
+    xcb_get_keyboard_mapping_cookie_t kcookie;
+    xcb_get_modifier_mapping_cookie_t mcookie;
+    xcb_get_keyboard_mapping_reply_t* kreply;
+    xcb_get_modifier_mapping_reply_t* mreply;
+    xcb_keysym_t* xsyms;
+    KeySym* syms;
+    int n, i;
+
+    xcb_prefetch_extension_data(conn, &xcb_test_id);
+    kcookie = xcb_get_keyboard_mapping(conn, setup->min_keycode,
+                                       setup->max_keycode
+                                       - setup->min_keycode + 1);
+    mcookie = xcb_get_modifier_mapping(conn);
+    ck->stats.requests += 3;
+    ck->stats.roundtrips += 1;
+
+    xtest = xcb_get_extension_data(conn, &xcb_test_id);
+    kreply = xcb_get_keyboard_mapping_reply(conn, kcookie, 0);
+    mreply = xcb_get_modifier_mapping_reply(conn, mcookie, 0);
+    if (!kreply || !mreply) {
+        printf("crikey: Can't get the keyboard mapping\n");
+        free(kreply);
+        free(mreply);
+        return xtest && xtest->present;
+    }
+
+    /* xcb keysyms are 32 bits; KeySym may be wider */
+    xsyms = xcb_get_keyboard_mapping_keysyms(kreply);
+    n = xcb_get_keyboard_mapping_keysyms_length(kreply);
+    syms = malloc(n * sizeof *syms);
+    if (!syms)
+        outOfMemory(ck);
+    else {
+        for (i = 0; i < n; ++i)
+            syms[i] = xsyms[i];
+        buildKeymapFrom(ck, syms, setup->min_keycode, setup->max_keycode,
+                        kreply->keysyms_per_keycode,
+                        xcb_get_modifier_mapping_keycodes(mreply),
+                        mreply->keycodes_per_modifier);
+        free(syms);
+    }
+    free(kreply);
+    free(mreply);
+    return xtest && xtest->present;
+}
+#endif /* HAVE_XCB */
+
+/* Send any spare keycode bindings made since the last batch,
+ * in one request covering all of them.
+ */
+static void applyRemaps(crikey* ck)
+{
+    int i, j, lo = 256, hi = -1;
+
+    for (i = 0; i < ck->numSpares; ++i) {
+        if (!ck->spares[i].dirty)
+            continue;
+        if (ck->spares[i].keycode < lo)
+            lo = ck->spares[i].keycode;
+        if (ck->spares[i].keycode > hi)
+            hi = ck->spares[i].keycode;
+        for (j = 0; j < ck->keysymsPer; ++j)
+            ck->keymapSyms[(ck->spares[i].keycode - ck->minKeycode)
+                           * ck->keysymsPer + j]
+                = (j < 2) ? ck->spares[i].keysym : NoSymbol;
+        ck->spares[i].dirty = 0;
+    }
+    if (hi < 0)
+        return;
+
+    if (ck->debug)
+        printf("Remapping keycodes %d-%d\n", lo, hi);
+    XChangeKeyboardMapping(ck->disp, lo, ck->keysymsPer,
+                           ck->keymapSyms
+                               + (lo - ck->minKeycode) * ck->keysymsPer,
+                           hi - lo + 1);
+    ++ck->stats.requests;
+    ++ck->ownRemaps;
+}
+
+static void restoreSpares(crikey* ck)
+{
+    int i;
+
+    for (i = 0; i < ck->numSpares; ++i)
+        if (ck->spares[i].keysym != NoSymbol) {
+            ck->spares[i].keysym = NoSymbol;
+            ck->spares[i].dirty = 1;
+        }
+    applyRemaps(ck);
+    XSync(ck->disp, False);
+}
+
+/*
+ * Pasting (--paste): a long run of plain text goes through a selection
+ * instead of being typed. We own the selection, send the paste chord,
+ * and serve the text to whichever client asks for it, in INCR pieces
+ * if it's bigger than a request can carry. The paste is done when the
+ * client deletes the property holding the last of it, which means it
+ * has read it all, so keys typed after it arrive after the text.
+ */
+static char* AtomNames[NUM_ATOMS] = {
+    "CLIPBOARD", "TARGETS", "TIMESTAMP", "UTF8_STRING", "TEXT", "INCR",
+    "_CRIKEY_TIME", "_NET_WM_NAME", "WM_STATE"
+};
+
+/* Stop listening to a window we were watching for a transfer */
+static void endTransfer(crikey* ck)
+{
+    XSelectInput(ck->disp, ck->xferWin,
+                 ck->xferWin == ck->focusWin ? FocusChangeMask : 0);
+    ++ck->stats.requests;
+    ck->xferWin = None;
+}
+
+static void serveSelection(crikey* ck, XSelectionRequestEvent* req)
+{
+    XSelectionEvent reply;
+    Atom prop = (req->property != None) ? req->property : req->target;
+
+    reply.type = SelectionNotify;
+    reply.display = req->display;
+    reply.requestor = req->requestor;
+    reply.selection = req->selection;
+    reply.target = req->target;
+    reply.property = prop;
+    reply.time = req->time;
+
+    if (req->owner != ck->pasteWin || req->selection != ck->pasteSel
+        || !ck->pasteOwned
+        || (req->time != CurrentTime && req->time < ck->pasteTime))
+        reply.property = None;
+    else if (req->target == ck->atoms[A_TARGETS]) {
+        Atom targets[5];
+
+        targets[0] = ck->atoms[A_TARGETS];
+        targets[1] = ck->atoms[A_TIMESTAMP];
+        targets[2] = ck->atoms[A_UTF8_STRING];
+        targets[3] = ck->atoms[A_TEXT];
+        targets[4] = XA_STRING;
+        XChangeProperty(ck->disp, req->requestor, prop, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char*)targets, 5);
+    }
+    else if (req->target == ck->atoms[A_TIMESTAMP]) {
+        long t = ck->pasteTime;
+
+        XChangeProperty(ck->disp, req->requestor, prop, XA_INTEGER, 32,
+                        PropModeReplace, (unsigned char*)&t, 1);
+    }
+    else if ((req->target == ck->atoms[A_UTF8_STRING]
+              || req->target == ck->atoms[A_TEXT]
+              || req->target == XA_STRING)
+             && ck->xferWin == None) {
+        ck->xferWin = req->requestor;
+        ck->xferProp = prop;
+        ck->xferType = (req->target == XA_STRING)
+                       ? XA_STRING : ck->atoms[A_UTF8_STRING];
+        /* We'll need to see the client delete what we give it */
+        XSelectInput(ck->disp, req->requestor, PropertyChangeMask
+                     | (req->requestor == ck->focusWin ? FocusChangeMask
+                                                       : 0));
+        if (ck->pasteLen > ck->pasteChunk) {
+            long len = ck->pasteLen;
+
+            XChangeProperty(ck->disp, req->requestor, prop,
+                            ck->atoms[A_INCR], 32, PropModeReplace,
+                            (unsigned char*)&len, 1);
+            ck->xferOff = 0;
+        }
+        else {
+            XChangeProperty(ck->disp, req->requestor, prop, ck->xferType, 8,
+                            PropModeReplace, (unsigned char*)ck->pasteBuf,
+                            ck->pasteLen);
+            ck->xferOff = ck->pasteLen + 1;     /* nothing more to send */
+        }
+        ck->requested = 1;
+        if (ck->debug)
+            printf("Pasting %lu bytes to 0x%lx%s\n",
+                   (unsigned long)ck->pasteLen, req->requestor,
+                   ck->xferOff ? "" : " in pieces");
+        ++ck->stats.requests;
+    }
+    else
+        reply.property = None;
+
+    XSendEvent(ck->disp, req->requestor, False, 0, (XEvent*)&reply);
+    ck->stats.requests += 2;
+}
+
+/* The client has taken a piece of an INCR transfer: send the next,
+ * then an empty one to say that's all. Once it has taken that too,
+ * or the whole thing in one go, the paste is finished.
+ */
+static void nextTransferPiece(crikey* ck)
+{
+    size_t n;
+
+    if (ck->xferOff > ck->pasteLen) {
+        endTransfer(ck);
+        ck->pasteDone = 1;
+        return;
+    }
+    n = ck->pasteLen - ck->xferOff;
+    if (n > ck->pasteChunk)
+        n = ck->pasteChunk;
+    XChangeProperty(ck->disp, ck->xferWin, ck->xferProp, ck->xferType, 8,
+                    PropModeReplace,
+                    (unsigned char*)ck->pasteBuf + ck->xferOff, n);
+    ++ck->stats.requests;
+    /* The empty piece moves xferOff past the end */
+    ck->xferOff += n ? n : 1;
+}
+
+/* Handle the events that have to do with pasting. Returns 1 if ev
+ * was one of those.
+ */
+static int handleSelectionEvent(crikey* ck, XEvent* ev)
+{
+    switch (ev->type) {
+      case SelectionRequest:
+          serveSelection(ck, &ev->xselectionrequest);
+          return 1;
+      case SelectionClear:
+          if (ev->xselectionclear.selection == ck->pasteSel)
+              ck->pasteOwned = 0;
+          return 1;
+      case PropertyNotify:
+          if (ev->xproperty.window == ck->xferWin
+              && ev->xproperty.atom == ck->xferProp
+              && ev->xproperty.state == PropertyDelete)
+              nextTransferPiece(ck);
+          return ev->xproperty.window == ck->xferWin
+                 || ev->xproperty.window == ck->pasteWin;
+    }
+    return 0;
+}
+
+/* Deal with an event from the server: keyboard map changes
+ * (e.g. setxkbmap), focus changes away from the window we've been
+ * sending to, and selection requests after a paste.
+ * Returns 1 if the keymap cache needs rebuilding.
+ */
+static int handleEvent(crikey* ck, XEvent* ev)
+{
+    if (ck->pasteWin && handleSelectionEvent(ck, ev))
+        return 0;
+    if (ev->type == FocusOut && ev->xfocus.window == ck->focusWin) {
+        if (ck->debug)
+            printf("Focus window 0x%lx lost focus\n", ck->focusWin);
+        ck->focusWin = None;
+        return 0;
+    }
+    if (ev->type == MappingNotify) {
+        XRefreshKeyboardMapping(&ev->xmapping);
+        /* Our own remaps: the cache already knows about them */
+        if (ev->xmapping.request == MappingKeyboard && ck->ownRemaps > 0
+            && ck->numSpares > 0
+            && ev->xmapping.first_keycode >= ck->spares[0].keycode
+            && ev->xmapping.first_keycode + ev->xmapping.count - 1
+               <= ck->spares[ck->numSpares-1].keycode) {
+            --ck->ownRemaps;
+            return 0;
+        }
+        return ev->xmapping.request != MappingPointer;
+    }
+    return 0;
+}
+
+/* Handle whatever events have come in (see handleEvent), and rebuild
+ * the keymap cache if the map changed. Called between pieces of long
+ * input, between daemon requests, before trusting the cached focus
+ * window and before starting a paste.
+ */
+static void handlePendingEvents(crikey* ck)
+{
+    XEvent ev;
+    int changed = 0;
+
+    if (!ck->disp)      /* uinput: no server, no events */
+        return;
+    while (XPending(ck->disp)) {
+        XNextEvent(ck->disp, &ev);
+        changed |= handleEvent(ck, &ev);
+    }
+    if (changed) {
+        if (ck->debug) printf("Keyboard mapping changed\n");
+        buildKeymapCache(ck);
+    }
+}
+
+/*
+ * Compiled event programs (--compile/--play): the queue saved to a file
+ * so it can be replayed without parsing or resolving anything.
+ * The header records which keyboard map the keycodes came from;
+ * if the map has changed, --play re-resolves each keysym.
+ * Everything is in host byte order.
+ */
+#define PROGRAM_MAGIC "CRKYPRG1"
+
+typedef struct {
+    char magic[8];
+    uint32_t keymapHash;
+    uint32_t reserved;
+} ProgramHeader;
+
+typedef struct {
+    unsigned char type;
+    unsigned char keycode;
+    unsigned char modmask;
+    unsigned char mods;
+    uint32_t keysym;
+    uint32_t arg;
+} ProgramRecord;
+
+static void writeProgram(crikey* ck)
+{
+    ProgramRecord rec;
+    int i;
+
+    for (i = 0; i < ck->queueLen; ++i) {
+        rec.type = ck->queue[i].type;
+        /* Spare keycode bindings won't be there when it's played */
+        rec.keycode = ck->isSpare[ck->queue[i].keycode]
+                      ? 0 : ck->queue[i].keycode;
+        rec.modmask = ck->queue[i].modmask;
+        rec.mods = ck->queue[i].mods;
+        rec.keysym = ck->queue[i].keysym;
+        rec.arg = ck->queue[i].arg;
+        fwrite(&rec, sizeof rec, 1, ck->programOut);
+    }
+}
+
+/*
+ * The uinput backend works without an X server (Wayland, the console),
+ * by creating a virtual keyboard with /dev/uinput; or, with -U, it
+ * writes the same input_event stream to a file or pipe.  Events are
+ * collected and written a batch at a time, with one SYN_REPORT for
+ * each group of presses or releases rather than one per event.
+ *
+ * With no server to ask for the keyboard map, it uses this US layout.
+ * Keycodes in the cache are X keycodes, which are evdev codes + 8.
+ */
+static const struct {
+    unsigned short code;
+    KeySym plain, shifted;
+} UinputKeymap[] = {
+    { KEY_ESC, XK_Escape, NoSymbol },
+    { KEY_1, XK_1, XK_exclam },         { KEY_2, XK_2, XK_at },
+    { KEY_3, XK_3, XK_numbersign },     { KEY_4, XK_4, XK_dollar },
+    { KEY_5, XK_5, XK_percent },        { KEY_6, XK_6, XK_asciicircum },
+    { KEY_7, XK_7, XK_ampersand },      { KEY_8, XK_8, XK_asterisk },
+    { KEY_9, XK_9, XK_parenleft },      { KEY_0, XK_0, XK_parenright },
+    { KEY_MINUS, XK_minus, XK_underscore },
+    { KEY_EQUAL, XK_equal, XK_plus },
+    { KEY_BACKSPACE, XK_BackSpace, NoSymbol },
+    { KEY_TAB, XK_Tab, XK_ISO_Left_Tab },
+    { KEY_Q, XK_q, XK_Q }, { KEY_W, XK_w, XK_W }, { KEY_E, XK_e, XK_E },
+    { KEY_R, XK_r, XK_R }, { KEY_T, XK_t, XK_T }, { KEY_Y, XK_y, XK_Y },
+    { KEY_U, XK_u, XK_U }, { KEY_I, XK_i, XK_I }, { KEY_O, XK_o, XK_O },
+    { KEY_P, XK_p, XK_P },
+    { KEY_LEFTBRACE, XK_bracketleft, XK_braceleft },
+    { KEY_RIGHTBRACE, XK_bracketright, XK_braceright },
+    { KEY_ENTER, XK_Return, NoSymbol },
+    { KEY_LEFTCTRL, XK_Control_L, NoSymbol },
+    { KEY_A, XK_a, XK_A }, { KEY_S, XK_s, XK_S }, { KEY_D, XK_d, XK_D },
+    { KEY_F, XK_f, XK_F }, { KEY_G, XK_g, XK_G }, { KEY_H, XK_h, XK_H },
+    { KEY_J, XK_j, XK_J }, { KEY_K, XK_k, XK_K }, { KEY_L, XK_l, XK_L },
+    { KEY_SEMICOLON, XK_semicolon, XK_colon },
+    { KEY_APOSTROPHE, XK_apostrophe, XK_quotedbl },
+    { KEY_GRAVE, XK_grave, XK_asciitilde },
+    { KEY_LEFTSHIFT, XK_Shift_L, NoSymbol },
+    { KEY_BACKSLASH, XK_backslash, XK_bar },
+    { KEY_Z, XK_z, XK_Z }, { KEY_X, XK_x, XK_X }, { KEY_C, XK_c, XK_C },
+    { KEY_V, XK_v, XK_V }, { KEY_B, XK_b, XK_B }, { KEY_N, XK_n, XK_N },
+    { KEY_M, XK_m, XK_M },
+    { KEY_COMMA, XK_comma, XK_less },
+    { KEY_DOT, XK_period, XK_greater },
+    { KEY_SLASH, XK_slash, XK_question },
+    { KEY_RIGHTSHIFT, XK_Shift_R, NoSymbol },
+    { KEY_LEFTALT, XK_Alt_L, NoSymbol },
+    { KEY_SPACE, XK_space, NoSymbol },
+    { KEY_CAPSLOCK, XK_Caps_Lock, NoSymbol },
+    { KEY_F1, XK_F1, NoSymbol },   { KEY_F2, XK_F2, NoSymbol },
+    { KEY_F3, XK_F3, NoSymbol },   { KEY_F4, XK_F4, NoSymbol },
+    { KEY_F5, XK_F5, NoSymbol },   { KEY_F6, XK_F6, NoSymbol },
+    { KEY_F7, XK_F7, NoSymbol },   { KEY_F8, XK_F8, NoSymbol },
+    { KEY_F9, XK_F9, NoSymbol },   { KEY_F10, XK_F10, NoSymbol },
+    { KEY_F11, XK_F11, NoSymbol }, { KEY_F12, XK_F12, NoSymbol },
+    { KEY_SYSRQ, XK_Print, NoSymbol },
+    { KEY_RIGHTCTRL, XK_Control_R, NoSymbol },
+    { KEY_RIGHTALT, XK_Alt_R, NoSymbol },
+    { KEY_HOME, XK_Home, NoSymbol },     { KEY_UP, XK_Up, NoSymbol },
+    { KEY_PAGEUP, XK_Prior, NoSymbol },  { KEY_LEFT, XK_Left, NoSymbol },
+    { KEY_RIGHT, XK_Right, NoSymbol },   { KEY_END, XK_End, NoSymbol },
+    { KEY_DOWN, XK_Down, NoSymbol },     { KEY_PAGEDOWN, XK_Next, NoSymbol },
+    { KEY_INSERT, XK_Insert, NoSymbol }, { KEY_DELETE, XK_Delete, NoSymbol },
+    { KEY_LEFTMETA, XK_Super_L, NoSymbol },
+    { KEY_RIGHTMETA, XK_Super_R, NoSymbol },
+    { KEY_COMPOSE, XK_Menu, NoSymbol },
+};
+#define NUM_UINPUT_KEYS ((sizeof UinputKeymap) / (sizeof *UinputKeymap))
+#define EVDEV_OFFSET 8
+
+static void buildUinputKeymap(crikey* ck)
+{
+    KeySym syms[(256 - EVDEV_OFFSET) * 2];
+    static const KeyCode modkeys[8 * 2] = {
+        KEY_LEFTSHIFT + EVDEV_OFFSET, KEY_RIGHTSHIFT + EVDEV_OFFSET,
+        KEY_CAPSLOCK + EVDEV_OFFSET, 0,
+        KEY_LEFTCTRL + EVDEV_OFFSET, KEY_RIGHTCTRL + EVDEV_OFFSET,
+        KEY_LEFTALT + EVDEV_OFFSET, KEY_RIGHTALT + EVDEV_OFFSET,
+        0, 0,
+        0, 0,
+        KEY_LEFTMETA + EVDEV_OFFSET, KEY_RIGHTMETA + EVDEV_OFFSET,
+        0, 0,
+    };
+    int i;
+
+    memset(syms, 0, sizeof syms);
+    for (i = 0; i < NUM_UINPUT_KEYS; ++i) {
+        syms[UinputKeymap[i].code * 2] = UinputKeymap[i].plain;
+        syms[UinputKeymap[i].code * 2 + 1] = UinputKeymap[i].shifted;
+    }
+    buildKeymapFrom(ck, syms, EVDEV_OFFSET, 255, 2, modkeys, 2);
+
+    /* There's no keyboard map to change, so nothing is spare */
+    ck->numSpares = 0;
+    memset(ck->isSpare, 0, sizeof ck->isSpare);
+}
+
+/* Open the output: a new uinput device, or a file ("-" for stdout) */
+static int openUinput(crikey* ck, const char* filename)
+{
+    struct uinput_user_dev dev;
+    int i;
+
+    if (filename) {
+        ck->uinputFd = strcmp(filename, "-") ? open(filename,
+                                                O_WRONLY|O_CREAT|O_TRUNC,
+                                                0644)
+                                         : 1;
+        if (ck->uinputFd < 0) {
+            perror(filename);
+            return -1;
+        }
+        return 0;
+    }
+
+    ck->uinputFd = open("/dev/uinput", O_WRONLY);
+    if (ck->uinputFd < 0) {
+        perror("/dev/uinput");
+        return -1;
+    }
+    ioctl(ck->uinputFd, UI_SET_EVBIT, EV_KEY);
+    ioctl(ck->uinputFd, UI_SET_EVBIT, EV_SYN);
+    for (i = 0; i < NUM_UINPUT_KEYS; ++i)
+        ioctl(ck->uinputFd, UI_SET_KEYBIT, UinputKeymap[i].code);
+
+    memset(&dev, 0, sizeof dev);
+    snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "crikey");
+    dev.id.bustype = BUS_VIRTUAL;
+    dev.id.vendor = 1;
+    dev.id.product = 1;
+    dev.id.version = 1;
+    if (write(ck->uinputFd, &dev, sizeof dev) != sizeof dev
+        || ioctl(ck->uinputFd, UI_DEV_CREATE) < 0) {
+        perror("crikey: creating uinput device");
+        return -1;
+    }
+    ck->uinputDevice = 1;
+    /* Give udev and the compositor time to pick up the new keyboard,
+     * or the first keys go nowhere.
+     */
+    usleep(200000);
+    return 0;
+}
+
+/* Write everything collected so far in one go */
+static void writeUinput(crikey* ck)
+{
+    char* p = (char*)ck->uinputBuf;
+    size_t left = ck->uinputLen * sizeof *ck->uinputBuf;
+    ssize_t n;
+
+    while (left > 0) {
+        n = write(ck->uinputFd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("crikey: writing events");
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    ck->uinputLen = 0;
+}
+
+static void uinputEvent(crikey* ck, int type, int code, int value)
+{
+    struct timeval tv;
+    struct input_event* ev;
+
+    if (ck->uinputLen >= ck->uinputSize) {
+        int size = ck->uinputSize ? ck->uinputSize * 2 : 256;
+        struct input_event* buf = realloc(ck->uinputBuf, size * sizeof *buf);
+
+        if (buf) {
+            ck->uinputBuf = buf;
+            ck->uinputSize = size;
+        }
+        else if (ck->uinputLen > 0)
+            /* Send what we have and start the buffer again */
+            writeUinput(ck);
+        else {
+            outOfMemory(ck);
+            return;
+        }
+    }
+    ev = &ck->uinputBuf[ck->uinputLen++];
+    gettimeofday(&tv, 0);
+    ev->input_event_sec = tv.tv_sec;
+    ev->input_event_usec = tv.tv_usec;
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+/* Make sure the events so far are on their way */
+static void sendPending(crikey* ck)
+{
+    if (ck->useUinput)
+        writeUinput(ck);
+    else if (ck->disp)
+        XFlush(ck->disp);
+}
+
+/*
+ * Pacing: with -p, each key has an absolute deadline, one interval
+ * after the last one's, so time spent sending doesn't add up to drift.
+ * With -a, every ADAPT_KEYS keys we time an XSync and speed up while the
+ * server keeps up easily, or back off when it takes longer than a key.
+ */
+#define ADAPT_KEYS 16
+#define MIN_RATE 5
+#define MAX_RATE 2000
+#define NSEC 1000000000L
+
+static long nsecSince(struct timespec* then)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * NSEC + now.tv_nsec - then->tv_nsec;
+}
+
+static void paceKey(crikey* ck)
+{
+    long interval, late;
+
+    if (!ck->rate)
+        return;
+    interval = NSEC / ck->rate;
+
+    if (ck->adaptive && ++ck->adaptKeys >= ADAPT_KEYS) {
+        struct timespec start;
+        long rtt;
+
+        ck->adaptKeys = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        syncDisplay(ck);
+        rtt = nsecSince(&start);
+        if (rtt > interval)
+            ck->rate = ck->rate * 3 / 4;
+        else if (rtt < interval / 4)
+            ck->rate += ck->rate / 8 + 1;
+        if (ck->rate < MIN_RATE)
+            ck->rate = MIN_RATE;
+        if (ck->rate > MAX_RATE)
+            ck->rate = MAX_RATE;
+        interval = NSEC / ck->rate;
+        if (ck->debug)
+            printf("XSync took %ld us, rate now %d keys/sec\n",
+                   rtt / 1000, ck->rate);
+    }
+
+    if (ck->nextKeyTime.tv_sec == 0
+        || (late = nsecSince(&ck->nextKeyTime)) > interval) {
+        /* First key, or so far behind that catching up would
+         * mean a burst: start the schedule over from now.
+         */
+        clock_gettime(CLOCK_MONOTONIC, &ck->nextKeyTime);
+    }
+    else if (late < 0) {
+        /* Let the keys so far go out before we sleep */
+        int old = setPhase(ck, PH_WAIT);
+        sendPending(ck);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                               &ck->nextKeyTime, 0) == EINTR)
+            ;
+        setPhase(ck, old);
+    }
+
+    ck->nextKeyTime.tv_nsec += interval;
+    ck->nextKeyTime.tv_sec += ck->nextKeyTime.tv_nsec / NSEC;
+    ck->nextKeyTime.tv_nsec %= NSEC;
+}
+
+static void delayEvents(crikey* ck, unsigned int msec)
+{
+    struct timespec ts;
+    int old = setPhase(ck, PH_WAIT);
+
+    sendPending(ck);
+    /* Not usleep: msec * 1000 doesn't fit in 32 bits for long waits */
+    ts.tv_sec = msec / 1000;
+    ts.tv_nsec = msec % 1000 * 1000000L;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !stopping(ck))
+        ;
+    setPhase(ck, old);
+    /* Pacing picks up again from the end of the delay */
+    ck->nextKeyTime.tv_sec = 0;
+}
+
+#ifdef HAVE_XCB
+/* The XCB backend doesn't wait for anything as it sends; it keeps
+ * the cookies and checks them for errors once per batch.
+ */
+static void checkCookies(crikey* ck)
+{
+    xcb_connection_t* conn = XGetXCBConnection(ck->disp);
+    xcb_generic_error_t* err;
+    int i, old = setPhase(ck, PH_SYNC);
+
+    /* The first check waits for the server; the rest are known by then */
+    for (i = 0; i < ck->numCookies; ++i) {
+        err = xcb_request_check(conn, ck->cookies[i]);
+        if (err) {
+            printf("crikey: XTest request failed with error %d\n",
+                   err->error_code);
+            free(err);
+        }
+    }
+    if (ck->numCookies) {
+        ++ck->stats.requests;
+        ++ck->stats.roundtrips;
+    }
+    ck->numCookies = 0;
+    setPhase(ck, old);
+}
+#endif /* HAVE_XCB */
+
+static void fakeKey(crikey* ck, KeyCode keycode, int press)
+{
+    if (ck->useNull) {
+        /* Nothing goes anywhere, but two runs that would have sent
+         * the same events end up with the same hash.
+         */
+        ck->stats.eventhash = (uint32_t)((ck->stats.eventhash
+                                          ^ (keycode << 1 | press))
+                                         * 16777619u);
+        return;
+    }
+    if (ck->useUinput) {
+        uinputEvent(ck, EV_KEY, keycode - EVDEV_OFFSET, press);
+        return;
+    }
+#ifdef HAVE_XCB
+    if (ck->useXCB) {
+        if (ck->numCookies >= ck->cookiesSize) {
+            int size = ck->cookiesSize ? ck->cookiesSize * 2 : 256;
+            xcb_void_cookie_t* cookies = realloc(ck->cookies,
+                                                 size * sizeof *cookies);
+
+            if (cookies) {
+                ck->cookies = cookies;
+                ck->cookiesSize = size;
+            }
+            else if (ck->numCookies > 0)
+                /* Check the ones we have and start the array again */
+                checkCookies(ck);
+            else {
+                outOfMemory(ck);
+                return;
+            }
+        }
+        ck->cookies[ck->numCookies++] =
+            xcb_test_fake_input_checked(XGetXCBConnection(ck->disp),
+                                        press ? XCB_KEY_PRESS
+                                              : XCB_KEY_RELEASE,
+                                        keycode, XCB_CURRENT_TIME,
+                                        XCB_NONE, 0, 0, 0);
+        ++ck->stats.requests;
+        return;
+    }
+#endif
+    XTestFakeKeyEvent(ck->disp, keycode, press, 0);
+    ++ck->stats.requests;
+}
+
+/* The modifier mask a modifier keysym sets, else 0 */
+static int keysymModifier(crikey* ck, KeySym keysym)
+{
+    switch (keysym) {
+      case XK_Shift_L: case XK_Shift_R:
+          return ShiftMask;
+      case XK_Control_L: case XK_Control_R:
+          return ControlMask;
+      case XK_Alt_L: case XK_Alt_R: case XK_Meta_L: case XK_Meta_R:
+          return Mod1Mask;
+      case XK_Super_L: case XK_Super_R:
+          return Mod4Mask;
+      case XK_ISO_Level3_Shift:
+          return ck->modifiers[LEVEL3].mask;
+    }
+    return 0;
+}
+
+/* Windows can go away while we look at them, watch them or send
+ * to them
+ */
+static int ignoreXError(Display* disp, XErrorEvent* err)
+{
+    return 0;
+}
+
+/* Where XSendEvent events should go: the root window with -r,
+ * else the focused window, asking the server only when the focus
+ * has changed since we last looked. Returns None if nothing has focus.
+ */
+static Window focusWindow(crikey* ck)
+{
+    Window win;
+    int revert_to;
+
+    /* Crikey used to get the focused window and send events
+     * directly there. But then you can't send commands to your
+     * window manager, like alt-tab. Sending to the root window
+     * gives the window manager a chance to intercept first.
+     */
+    if (ck->useRootWin) {
+        if (ck->debug) printf("Sending to root window\n");
+        return DefaultRootWindow(ck->disp);
+    }
+
+    /* Catch any FocusOut that arrived since the last batch */
+    if (ck->focusWin != None && XPending(ck->disp))
+        handlePendingEvents(ck);
+    if (ck->focusWin != None)
+        return ck->focusWin;
+
+    XGetInputFocus(ck->disp, &win, &revert_to);
+    ++ck->stats.requests;
+    ++ck->stats.roundtrips;
+    if (win == None)
+        return None;
+
+    /* With PointerRoot focus, the focus follows the mouse without
+     * telling us, so that can't be cached.
+     */
+    if (win != PointerRoot) {
+        XSelectInput(ck->disp, win, FocusChangeMask);
+        ++ck->stats.requests;
+        ck->focusWin = win;
+        if (ck->debug) printf("Focus window is 0x%lx\n", win);
+    }
+    return win;
+}
+
+#define FAKE_KEY(dpy,k,p,dl) { \
+            if (ck->debug) \
+                printf("Faking key event(%p, %d, %d, %d)\n", \
+                       dpy, k, p, dl); \
+            fakeKey(dpy, k, p); \
+            traceKey(ck, k, p); \
+        }
+
+/* Move the modifiers we're holding down from held to want:
+ * release the ones no longer wanted (in reverse order), then press
+ * the new ones. Modifiers stay down across keys that share them,
+ * so "HELLO" is one Shift press and release, not five.
+ * Returns the new held mask.
+ */
+static int setModifiers(crikey* ck, int held, int want)
+{
+    int m;
+
+    for (m = NUM_MODIFIERS-1; m >= 0; --m)
+        if ((held & ~want & ck->modifiers[m].mask)
+            && ck->modifiers[m].keycode)
+            FAKE_KEY(ck, ck->modifiers[m].keycode, False, 0);
+    for (m = 0; m < NUM_MODIFIERS; ++m)
+        if ((want & ~held & ck->modifiers[m].mask)
+            && ck->modifiers[m].keycode)
+            FAKE_KEY(ck, ck->modifiers[m].keycode, True, 0);
+    return want;
+}
+
+static void flushKeyPresses(crikey* ck)
+{
+    int i;
+    int oldphase;
+
+    if (ck->queueLen == 0)
+        return;
+    /* What's queued is dropped; the rest won't be typed either */
+    if (stopping(ck)) {
+        ck->queueLen = 0;
+        return;
+    }
+    oldphase = setPhase(ck, PH_SUBMIT);
+
+    if (ck->debug)
+        printf("Flushing %d queued keys\n", ck->queueLen);
+
+    if (ck->programOut) {
+        writeProgram(ck);
+        ck->queueLen = 0;
+        setPhase(ck, oldphase);
+        return;
+    }
+
+    applyRemaps(ck);
+
+    if (ck->useXTest || ck->useUinput || ck->useNull) {
+        int held = 0;
+
+        if (ck->useXTest) {
+            XTestGrabControl(ck->disp, True);
+            ++ck->stats.requests;
+        }
+
+        for (i = 0; i < ck->queueLen && !stopping(ck); ++i) {
+            KeyCode keycode = ck->queue[i].keycode;
+            int modmask = ck->queue[i].modmask;
+
+            if (ck->queue[i].type == KS_PRESS
+                || ck->queue[i].type == KS_RELEASE) {
+                /* Recorded: the modifiers are events of their own */
+                held = setModifiers(ck, held, 0);
+                if (ck->queue[i].type == KS_PRESS)
+                    paceKey(ck);
+                FAKE_KEY(ck, keycode, ck->queue[i].type == KS_PRESS, 0);
+                if (ck->useUinput)
+                    uinputEvent(ck, EV_SYN, SYN_REPORT, 0);
+                continue;
+            }
+            if (ck->queue[i].type == KS_DELAY) {
+                /* Don't leave modifiers held down while we sleep */
+                if (held) {
+                    held = setModifiers(ck, held, 0);
+                    if (ck->useUinput)
+                        uinputEvent(ck, EV_SYN, SYN_REPORT, 0);
+                }
+                delayEvents(ck, ck->queue[i].arg);
+                continue;
+            }
+            paceKey(ck);
+            if (ck->debug)
+                printf("XTest wth mask = 0x%x\n", modmask);
+
+            /* Only press or release modifiers that change */
+            held = setModifiers(ck, held, modmask);
+
+            FAKE_KEY(ck, keycode, True, 0);            /* key press */
+            if (ck->useUinput)
+                uinputEvent(ck, EV_SYN, SYN_REPORT, 0);
+            FAKE_KEY(ck, keycode, False, 0);           /* key release */
+            if (ck->useUinput)
+                uinputEvent(ck, EV_SYN, SYN_REPORT, 0);
+        }
+
+        /* Never leave a modifier down between batches */
+        if (held) {
+            setModifiers(ck, held, 0);
+            if (ck->useUinput)
+                uinputEvent(ck, EV_SYN, SYN_REPORT, 0);
+        }
+
+        if (ck->useUinput)
+            writeUinput(ck);
+        else if (ck->useXTest) {
+            /* One round trip for the whole batch */
+#ifdef HAVE_XCB
+            if (ck->useXCB)
+                checkCookies(ck);
+            else
+#endif
+                syncDisplay(ck);
+            XTestGrabControl(ck->disp, False);
+            ++ck->stats.requests;
+        }
+    }
+    else {
+        /* Use XSendEvent instead of XTest */
+        XKeyEvent* kevent = &ck->kevent;
+        Window focuswin = ck->numTargets ? None : focusWindow(ck);
+        XErrorHandler oldhandler = 0;
+        int t;
+
+        /* Everything but the key is the same for every event */
+        if (kevent->display != ck->disp) {
+            kevent->display = ck->disp;
+            kevent->root = DefaultRootWindow(ck->disp);
+            kevent->subwindow = None;
+            kevent->time = CurrentTime;
+            kevent->x = 1;
+            kevent->y = 1;
+            kevent->x_root = 1;
+            kevent->y_root = 1;
+            kevent->same_screen = TRUE;
+            kevent->type = KeyPress;
+        }
+
+        /* A window in the list may have gone away */
+        if (ck->numTargets)
+            oldhandler = XSetErrorHandler(ignoreXError);
+
+        for (i = 0; i < ck->queueLen && !stopping(ck); ++i) {
+            if (ck->queue[i].type == KS_DELAY) {
+                delayEvents(ck, ck->queue[i].arg);
+                /* The focus may well have moved while we waited */
+                if (!ck->numTargets)
+                    focuswin = focusWindow(ck);
+                continue;
+            }
+            if (focuswin == None && !ck->numTargets) {
+                printf("No focused window!\n");
+                break;
+            }
+            if (ck->queue[i].type == KS_PRESS
+                || ck->queue[i].type == KS_RELEASE) {
+                /* Recorded modifier keys go into the state of the
+                 * events after them, as on a real keyboard.
+                 * Releases aren't sent, as below.
+                 */
+                int mask = keysymModifier(ck, ck->queue[i].keysym);
+
+                if (ck->queue[i].type == KS_PRESS)
+                    ck->recordedState |= mask;
+                else
+                    ck->recordedState &= ~mask;
+                if (mask || ck->queue[i].type == KS_RELEASE)
+                    continue;
+            }
+            paceKey(ck);
+
+            kevent->keycode = ck->queue[i].keycode;
+            kevent->state = (ck->queue[i].type == KS_PRESS) ? ck->recordedState
+                                                       : ck->queue[i].modmask;
+            if (ck->debug)
+                printf("Sending an event with keycode = %d, "
+                       "modifier mask 0x%x\n",
+                       kevent->keycode, kevent->state);
+
+            if (ck->numTargets) {
+                /* Each key to every window before the next key */
+                for (t = 0; t < ck->numTargets; ++t) {
+                    kevent->window = ck->targets[t];
+                    XSendEvent(ck->disp, ck->targets[t], TRUE, KeyPressMask,
+                               (XEvent *)kevent);
+                }
+                ck->stats.requests += ck->numTargets;
+            }
+            else {
+                kevent->window = focuswin;
+                XSendEvent(ck->disp, focuswin, TRUE, KeyPressMask,
+                           (XEvent *)kevent);
+                ++ck->stats.requests;
+            }
+            traceKey(ck, kevent->keycode, True);
+            /* Wonder if we might ever need the key release --
+             * but in some contexts, that actually gets interpreted
+             * as another key press!
+            XSendEvent(ck->disp, focuswin, TRUE, KeyReleaseMask,
+                       (XEvent *)kevent);
+             */
+        }
+        syncDisplay(ck);
+        if (ck->numTargets)
+            XSetErrorHandler(oldhandler);
+    }
+
+    ck->queueLen = 0;
+    ++ck->flushCount;
+    setPhase(ck, oldphase);
+}
+
+/* Bind keysym to a spare keycode, reusing the binding if it's
+ * already there, else taking the least recently used one.
+ * Returns 0 if there are no spare keycodes.
+ */
+static KeyCode bindSpareKeycode(crikey* ck, KeySym keysym)
+{
+    int i, victim = -1;
+
+    for (i = 0; i < ck->numSpares; ++i) {
+        if (ck->spares[i].keysym == keysym) {
+            victim = i;
+            break;
+        }
+        if (victim < 0 || ck->spares[i].used < ck->spares[victim].used)
+            victim = i;
+    }
+    if (victim < 0)
+        return 0;
+
+    if (ck->spares[victim].keysym != keysym) {
+        /* Keys still waiting in the queue need the old binding */
+        if (ck->spares[victim].keysym != NoSymbol
+            && ck->spares[victim].flush == ck->flushCount && ck->queueLen > 0)
+            flushKeyPresses(ck);
+        if (ck->debug)
+            printf("Binding keysym 0x%lx to spare keycode %d\n",
+                   keysym, ck->spares[victim].keycode);
+        ck->spares[victim].keysym = keysym;
+        ck->spares[victim].dirty = 1;
+        ck->sparesBound = 1;
+    }
+    ck->spares[victim].used = ++ck->spareClock;
+    ck->spares[victim].flush = ck->flushCount;
+    return ck->spares[victim].keycode;
+}
+
+/* Make room in the queue for n more strokes. -1 if there isn't any. */
+static int reserveQueue(crikey* ck, int n)
+{
+    KeyStroke* queue;
+    int size = ck->queueSize ? ck->queueSize : 256;
+
+    if (ck->queueLen + n <= ck->queueSize)
+        return 0;
+    while (ck->queueLen + n > size)
+        size *= 2;
+    queue = realloc(ck->queue, size * sizeof *queue);
+    if (!queue) {
+        outOfMemory(ck);
+        return -1;
+    }
+    ck->queue = queue;
+    ck->queueSize = size;
+    return 0;
+}
+
+static void queueStroke(crikey* ck, const KeyStroke* ks)
+{
+    if (reserveQueue(ck, 1) < 0)
+        return;
+    ck->queue[ck->queueLen++] = *ks;
+
+    /* Very long input goes out in pieces, so the server doesn't sit
+     * on a huge grab and the first keys show up promptly.
+     */
+    if (ck->batchSize > 0 && ck->queueLen >= ck->batchSize)
+        flushKeyPresses(ck);
+}
+
+/* Queue count presses of keysym (\(BackSpace*500\), \t{20}),
+ * resolving it only once.
+ */
+static void simulateKeyRepeat(crikey* ck, KeySym keysym, int modmask,
+                              int count)
+{
+    KeyStroke ks;
+    unsigned long flushes = ck->flushCount;
+
+    ks.type = KS_KEY;
+    ks.keysym = keysym;
+    ks.mods = modmask;
+    ks.arg = 0;
+    ks.keycode = lookupKeysym(ck, keysym, &modmask);
+    /* Not on the keyboard: borrow a spare keycode.
+     * A compiled program leaves that until it's played.
+     */
+    if (ks.keycode == 0 && !ck->programOut)
+        ks.keycode = bindSpareKeycode(ck, keysym);
+    ks.modmask = modmask;
+    if (ks.keycode == 0 && !ck->programOut) {
+        printf("crikey: Can't simulate keysym %ld: no keycode\n", keysym);
+        ck->stats.failed += count;
+        return;
+    }
+
+    if (ck->debug)
+        printf("keysym is %ld, keycode is %d, modmask is 0x%x%s\n",
+               keysym, ks.keycode, modmask, count != 1 ? " (repeated)" : "");
+
+    if (reserveQueue(ck, count) < 0)
+        return;
+    while (count-- > 0 && !ck->aborted)
+        queueStroke(ck, &ks);
+    /* If a long run went out in pieces, the spare keycode is still
+     * needed by the piece that's queued
+     */
+    if (ck->flushCount != flushes && ck->isSpare[ks.keycode]
+        && !ck->programOut)
+        bindSpareKeycode(ck, keysym);
+}
+
+static void simulateKeyPress(crikey* ck, KeySym keysym, int modmask)
+{
+    simulateKeyRepeat(ck, keysym, modmask, 1);
+}
+
+/* How long a client has to take pasted text, in milliseconds */
+#define PASTE_TIMEOUT 2000
+
+/* Wait for the next event, until deadline (from nowNsec).
+ * Returns 0 if there wasn't one in time.
+ */
+static int waitForEvent(crikey* ck, XEvent* ev, long long deadline)
+{
+    int fd = ConnectionNumber(ck->disp);
+    struct timeval tv;
+    long long left;
+    fd_set fds;
+
+    while (!XPending(ck->disp)) {
+        left = deadline - nowNsec();
+        if (left <= 0 || stopping(ck))
+            return 0;
+        tv.tv_sec = left / NSEC;
+        tv.tv_usec = left % NSEC / 1000;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (select(fd + 1, &fds, 0, 0, &tv) < 0 && errno != EINTR)
+            return 0;
+    }
+    XNextEvent(ck->disp, ev);
+    return 1;
+}
+
+/* The atoms, the first time we need them: one round trip for all */
+static int internAtoms(crikey* ck)
+{
+    if (ck->atoms[0] != None)
+        return 0;
+    ++ck->stats.requests;
+    ++ck->stats.roundtrips;
+    return XInternAtoms(ck->disp, AtomNames, NUM_ATOMS, False, ck->atoms)
+           ? 0 : -1;
+}
+
+/* A window to own the selection with */
+static int initPaste(crikey* ck)
+{
+    XSetWindowAttributes attr;
+
+    if (internAtoms(ck) < 0)
+        return -1;
+    attr.event_mask = PropertyChangeMask;
+    ck->pasteWin = XCreateWindow(ck->disp, DefaultRootWindow(ck->disp),
+                                 -10, -10, 1, 1, 0, 0, InputOnly,
+                                 CopyFromParent, CWEventMask, &attr);
+    ck->pasteChunk = XMaxRequestSize(ck->disp) * 4 - 256;
+    ++ck->stats.requests;
+    return ck->pasteWin ? 0 : -1;
+}
+
+/* Paste len bytes of text. Returns 0 once a client has taken it all,
+ * or -1 if nobody asked for it, so it can be typed instead.
+ */
+static int pasteText(crikey* ck, const char* text, size_t len)
+{
+    XEvent ev;
+    long long deadline;
+    int i, old, changed = 0;
+
+    if (len > ck->pasteSize) {
+        char* buf = realloc(ck->pasteBuf, len);
+
+        /* It can still be typed */
+        if (!buf)
+            return -1;
+        ck->pasteBuf = buf;
+        ck->pasteSize = len;
+    }
+    memcpy(ck->pasteBuf, text, len);
+    ck->pasteLen = len;
+
+    /* A transfer of the last paste can't still be going: that
+     * would be serving the new text as the rest of the old.
+     */
+    if (ck->xferWin != None)
+        endTransfer(ck);
+    ck->requested = ck->pasteDone = 0;
+    /* Anything still queued, so an old PropertyNotify isn't taken
+     * for the timestamp below.
+     */
+    handlePendingEvents(ck);
+
+    old = setPhase(ck, PH_SYNC);
+    /* The selection needs a real timestamp: get the server's time
+     * from a property change on our own window.
+     */
+    XChangeProperty(ck->disp, ck->pasteWin, ck->atoms[A_CRIKEY_TIME],
+                    XA_STRING, 8, PropModeAppend, (unsigned char*)"", 0);
+    XWindowEvent(ck->disp, ck->pasteWin, PropertyChangeMask, &ev);
+    ck->pasteTime = ev.xproperty.time;
+    XSetSelectionOwner(ck->disp, ck->pasteSel, ck->pasteWin, ck->pasteTime);
+    ck->pasteOwned = (XGetSelectionOwner(ck->disp, ck->pasteSel)
+                      == ck->pasteWin);
+    ck->stats.requests += 3;
+    ck->stats.roundtrips += 2;
+    setPhase(ck, old);
+    if (!ck->pasteOwned) {
+        printf("crikey: Couldn't get the selection to paste with\n");
+        return -1;
+    }
+
+    for (i = 0; i < ck->numChordKeys; ++i)
+        simulateKeyPress(ck, ck->chordKeys[i].keysym, ck->chordKeys[i].mods);
+    flushKeyPresses(ck);
+
+    old = setPhase(ck, PH_WAIT);
+    deadline = nowNsec() + PASTE_TIMEOUT * 1000000LL;
+    while (!ck->pasteDone) {
+        if (!waitForEvent(ck, &ev, deadline))
+            break;
+        changed |= handleEvent(ck, &ev);
+    }
+    setPhase(ck, old);
+    if (changed)
+        buildKeymapCache(ck);
+
+    if (!ck->pasteDone) {
+        if (ck->requested)
+            printf("crikey: Paste of %lu bytes didn't finish\n",
+                   (unsigned long)len);
+        else
+            printf("crikey: Nothing asked for the pasted text\n");
+        if (ck->xferWin != None)
+            endTransfer(ck);
+        /* If some of it went, typing it all again is worse */
+        return ck->requested ? 0 : -1;
+    }
+    return 0;
+}
+
+/*
+ * Waits (\(wait:focus\), \(wait:window:Title\)): rather than sleeping
+ * for a guess at how long an app takes to open a dialog, send the keys
+ * so far and wait for the X event that says it's there, for up to
+ * waitTimeout. If it doesn't come, the rest isn't typed, since it
+ * would only go to the wrong window.
+ */
+#define WAIT_TIMEOUT 10000
+
+/* The events we normally want from win */
+static long windowMask(crikey* ck, Window win)
+{
+    return (win == ck->focusWin ? FocusChangeMask : 0)
+           | (win == ck->xferWin ? PropertyChangeMask : 0);
+}
+
+/* Wait for the focus to move off from. With PointerRoot or None
+ * focus, the FocusOut goes to the root window.
+ */
+static int waitForFocus(crikey* ck, Window from, long long deadline)
+{
+    Window watch = (from == None || from == PointerRoot)
+                   ? DefaultRootWindow(ck->disp) : from;
+    Window win;
+    XEvent ev;
+    int revert, moved = 0, changed = 0;
+
+    XSelectInput(ck->disp, watch, windowMask(ck, watch) | FocusChangeMask);
+    ++ck->stats.requests;
+    for (;;) {
+        /* It may have moved before we were watching */
+        XGetInputFocus(ck->disp, &win, &revert);
+        ++ck->stats.requests;
+        ++ck->stats.roundtrips;
+        if (win != from) {
+            moved = 1;
+            break;
+        }
+        do {
+            if (!waitForEvent(ck, &ev, deadline))
+                goto done;
+            changed |= handleEvent(ck, &ev);
+        } while (ev.type != FocusOut || ev.xfocus.window != watch);
+    }
+    if (ck->debug)
+        printf("Focus moved from 0x%lx to 0x%lx\n", from, win);
+done:
+    XSelectInput(ck->disp, watch, windowMask(ck, watch));
+    ++ck->stats.requests;
+    if (changed)
+        buildKeymapCache(ck);
+    return moved;
+}
+
+/* win's title, malloced, or 0 if it hasn't one. _NET_WM_NAME is
+ * UTF-8; WM_NAME is for apps that don't set that.
+ */
+static char* windowTitle(crikey* ck, Window win)
+{
+    Atom type;
+    int format;
+    unsigned long n, after;
+    unsigned char* name = 0;
+    char* oldname = 0;
+    char* title;
+
+    ck->stats.requests += 2;
+    ck->stats.roundtrips += 2;
+    if (XGetWindowProperty(ck->disp, win, ck->atoms[A_NET_WM_NAME], 0, 1024,
+                           False, ck->atoms[A_UTF8_STRING], &type, &format,
+                           &n, &after, &name) == Success && name) {
+        title = strdup((char*)name);
+        XFree(name);
+        return title;
+    }
+    if (!XFetchName(ck->disp, win, &oldname) || !oldname)
+        return 0;
+    title = strdup(oldname);
+    XFree(oldname);
+    return title;
+}
+
+/* Does win's title have title in it? */
+static int titleMatches(crikey* ck, Window win, const char* title)
+{
+    char* name = windowTitle(ck, win);
+    int found = (name && strstr(name, title));
+
+    free(name);
+    return found;
+}
+
+/* Windows whose titles we're watching, to stop watching afterwards */
+typedef struct {
+    Window* wins;
+    int n, size;
+} WatchList;
+
+/* Look for a viewable window with title in its title among win's
+ * children, down to depth levels: a window manager's frame has the
+ * app's window a level or two down. Watch the title of each one that
+ * doesn't match, in case it changes.
+ */
+static int findWindow(crikey* ck, Window win, const char* title, int depth,
+                      WatchList* watched)
+{
+    Window root, parent, *children = 0;
+    XWindowAttributes attr;
+    unsigned int n, i;
+    int j, found = 0;
+
+    ++ck->stats.requests;
+    ++ck->stats.roundtrips;
+    if (!XQueryTree(ck->disp, win, &root, &parent, &children, &n))
+        return 0;
+    for (i = 0; i < n && !found; ++i) {
+        ck->stats.requests += 2;
+        ++ck->stats.roundtrips;
+        if (!XGetWindowAttributes(ck->disp, children[i], &attr)
+            || attr.map_state != IsViewable)
+            continue;
+        if (titleMatches(ck, children[i], title)) {
+            if (ck->debug)
+                printf("Window 0x%lx has \"%s\" in its title\n",
+                       children[i], title);
+            found = 1;
+            break;
+        }
+        for (j = 0; j < watched->n && watched->wins[j] != children[i]; ++j)
+            ;
+        if (j == watched->n && watched->n >= watched->size) {
+            int size = watched->size ? watched->size * 2 : 64;
+            Window* wins = realloc(watched->wins, size * sizeof *wins);
+
+            /* Without room to remember it, don't watch it: only a
+             * change to its title will be missed
+             */
+            if (wins) {
+                watched->wins = wins;
+                watched->size = size;
+            }
+        }
+        if (j == watched->n && watched->n < watched->size) {
+            watched->wins[watched->n++] = children[i];
+            XSelectInput(ck->disp, children[i],
+                         windowMask(ck, children[i]) | PropertyChangeMask);
+            ++ck->stats.requests;
+        }
+        if (depth > 1)
+            found = findWindow(ck, children[i], title, depth - 1, watched);
+    }
+    if (children)
+        XFree(children);
+    return found;
+}
+
+/* Wait for a window with title in its title to be shown: look again
+ * whenever a window is mapped or a title we're watching changes.
+ */
+static int waitForWindow(crikey* ck, const char* title, long long deadline)
+{
+    Window root = DefaultRootWindow(ck->disp);
+    WatchList watched = { 0, 0, 0 };
+    XEvent ev;
+    int i, found, changed = 0;
+
+    if (internAtoms(ck) < 0)
+        return 0;
+    XSelectInput(ck->disp, root,
+                 windowMask(ck, root) | SubstructureNotifyMask);
+    ++ck->stats.requests;
+    while (!(found = findWindow(ck, root, title, 3, &watched))) {
+        do {
+            if (!waitForEvent(ck, &ev, deadline))
+                goto done;
+            changed |= handleEvent(ck, &ev);
+        } while (ev.type != MapNotify
+                 && !(ev.type == PropertyNotify
+                      && (ev.xproperty.atom == XA_WM_NAME
+                          || ev.xproperty.atom == ck->atoms[A_NET_WM_NAME])));
+    }
+done:
+    XSelectInput(ck->disp, root, windowMask(ck, root));
+    for (i = 0; i < watched.n; ++i)
+        XSelectInput(ck->disp, watched.wins[i],
+                     windowMask(ck, watched.wins[i]));
+    ck->stats.requests += 1 + watched.n;
+    free(watched.wins);
+    if (changed)
+        buildKeymapCache(ck);
+    return found;
+}
+
+/* Send what's queued, then wait for the focus to move (title 0)
+ * or for a window with title in its title. Returns 0 once it has,
+ * -1 if it timed out.
+ */
+static int waitFor(crikey* ck, const char* title)
+{
+    XErrorHandler oldhandler;
+    Window from = None;
+    long long deadline;
+    int revert, ok, old;
+
+    if (!ck->disp) {
+        printf("crikey: Waiting for windows needs an X server\n");
+        return 0;
+    }
+    /* Where the focus is before the keys that move it go out */
+    if (!title) {
+        XGetInputFocus(ck->disp, &from, &revert);
+        ++ck->stats.requests;
+        ++ck->stats.roundtrips;
+    }
+    flushKeyPresses(ck);
+
+    old = setPhase(ck, PH_WAIT);
+    deadline = nowNsec() + ck->waitTimeout * 1000000LL;
+    oldhandler = XSetErrorHandler(ignoreXError);
+    ok = title ? waitForWindow(ck, title, deadline)
+               : waitForFocus(ck, from, deadline);
+    /* Errors from the last requests have to come in while we're
+     * still ignoring them
+     */
+    XSync(ck->disp, False);
+    XSetErrorHandler(oldhandler);
+    setPhase(ck, old);
+    /* Pacing picks up again from here */
+    ck->nextKeyTime.tv_sec = 0;
+
+    if (!ok) {
+        /* If we were told to stop, the caller knows why */
+        if (stopping(ck))
+            return -1;
+        if (title)
+            printf("crikey: Timed out waiting for a window called %s\n",
+                   title);
+        else
+            printf("crikey: Timed out waiting for the focus to move\n");
+        ck->aborted = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/* \(wait:focus\) or \(wait:window:Title\). A wait for the focus goes
+ * in a compiled program; a window title won't fit.
+ */
+static int simulateWait(crikey* ck, const char* what)
+{
+    KeyStroke ks;
+
+    if (!strcmp(what, "focus")) {
+        if (!ck->programOut)
+            return waitFor(ck, 0);
+        memset(&ks, 0, sizeof ks);
+        ks.type = KS_WAIT;
+        queueStroke(ck, &ks);
+        return 0;
+    }
+    if (!strncmp(what, "window:", 7) && what[7]) {
+        if (!ck->programOut)
+            return waitFor(ck, what + 7);
+        printf("crikey: Can't save a wait for a window; leaving it out\n");
+        return 0;
+    }
+    printf("crikey: Don't know how to wait for %s\n", what);
+    return 0;
+}
+
+/*
+ * Broadcasting (-w ids, -W pattern): with XSendEvent, each key goes
+ * to every one of a set of windows in the same batch, so typing into
+ * thirty terminals takes no more round trips than typing into one.
+ * A pattern is matched once, when the context is opened, against the
+ * title and class of each application's window.
+ */
+
+/* The application's own window under a top-level one: the window
+ * manager puts WM_STATE on the windows it manages, and a frame has
+ * the one with it a level or two down. None if there isn't one.
+ */
+static Window clientWindow(crikey* ck, Window win, int depth)
+{
+    Window root, parent, *children = 0, client = None;
+    unsigned int n, i;
+    Atom type = None;
+    int format;
+    unsigned long nitems, after;
+    unsigned char* data = 0;
+
+    ++ck->stats.requests;
+    ++ck->stats.roundtrips;
+    if (XGetWindowProperty(ck->disp, win, ck->atoms[A_WM_STATE], 0, 0,
+                           False, AnyPropertyType, &type, &format,
+                           &nitems, &after, &data) == Success && data)
+        XFree(data);
+    if (type != None)
+        return win;
+    if (depth == 0)
+        return None;
+
+    ++ck->stats.requests;
+    ++ck->stats.roundtrips;
+    if (!XQueryTree(ck->disp, win, &root, &parent, &children, &n))
+        return None;
+    for (i = 0; i < n && client == None; ++i)
+        client = clientWindow(ck, children[i], depth - 1);
+    if (children)
+        XFree(children);
+    return client;
+}
+
+/* Does pattern (as in the shell) match win's title or class? */
+static int windowMatches(crikey* ck, Window win, const char* pattern)
+{
+    XClassHint hint;
+    char* title = windowTitle(ck, win);
+    int match = (title && fnmatch(pattern, title, 0) == 0);
+
+    free(title);
+    ++ck->stats.requests;
+    ++ck->stats.roundtrips;
+    if (!match && XGetClassHint(ck->disp, win, &hint)) {
+        match = (hint.res_name && fnmatch(pattern, hint.res_name, 0) == 0)
+            || (hint.res_class && fnmatch(pattern, hint.res_class, 0) == 0);
+        XFree(hint.res_name);
+        XFree(hint.res_class);
+    }
+    return match;
+}
+
+static void addTarget(crikey* ck, Window win)
+{
+    Window* targets = realloc(ck->targets, (ck->numTargets + 1)
+                                           * sizeof *targets);
+
+    if (!targets) {
+        outOfMemory(ck);
+        return;
+    }
+    ck->targets = targets;
+    ck->targets[ck->numTargets++] = win;
+}
+
+/* Add every window matching pattern to the targets */
+static void matchWindows(crikey* ck, const char* pattern)
+{
+    Window root, parent, *tops = 0, client;
+    XWindowAttributes attr;
+    XErrorHandler oldhandler;
+    unsigned int n, i;
+
+    if (internAtoms(ck) < 0)
+        return;
+    oldhandler = XSetErrorHandler(ignoreXError);
+    ++ck->stats.requests;
+    ++ck->stats.roundtrips;
+    if (XQueryTree(ck->disp, DefaultRootWindow(ck->disp), &root, &parent,
+                   &tops, &n)) {
+        for (i = 0; i < n; ++i) {
+            client = clientWindow(ck, tops[i], 2);
+            /* With no window manager, top-level windows that are shown */
+            if (client == None) {
+                ck->stats.requests += 2;
+                ++ck->stats.roundtrips;
+                if (!XGetWindowAttributes(ck->disp, tops[i], &attr)
+                    || attr.map_state != IsViewable)
+                    continue;
+                client = tops[i];
+            }
+            if (windowMatches(ck, client, pattern)) {
+                if (ck->debug)
+                    printf("Window 0x%lx matches %s\n", client, pattern);
+                addTarget(ck, client);
+            }
+        }
+        if (tops)
+            XFree(tops);
+    }
+    XSync(ck->disp, False);
+    XSetErrorHandler(oldhandler);
+}
+
+/* Send a program saved by --compile or --record */
+int crikey_play(crikey* ck, FILE* fp, const char* filename)
+{
+    ProgramHeader hdr;
+    ProgramRecord recs[1024];
+    KeyStroke ks;
+    size_t n, i;
+    int sameKeymap;
+
+    if (fread(&hdr, sizeof hdr, 1, fp) != 1
+        || memcmp(hdr.magic, PROGRAM_MAGIC, sizeof hdr.magic)) {
+        printf("crikey: %s is not a crikey program\n", filename);
+        fclose(fp);
+        return -1;
+    }
+    sameKeymap = (hdr.keymapHash == ck->keymapHash);
+    if (ck->debug && !sameKeymap)
+        printf("Keyboard map changed since %s was compiled\n", filename);
+
+    while ((n = fread(recs, sizeof *recs, 1024, fp)) > 0) {
+        for (i = 0; i < n; ++i) {
+            ks.type = recs[i].type;
+            ks.keycode = recs[i].keycode;
+            ks.modmask = recs[i].modmask;
+            ks.mods = recs[i].mods;
+            ks.keysym = recs[i].keysym;
+            ks.arg = recs[i].arg;
+
+            /* Recorded events carry the wait before them */
+            if (ks.type == KS_PRESS || ks.type == KS_RELEASE) {
+                if (ks.arg && ck->speed > 0) {
+                    KeyStroke delay;
+
+                    memset(&delay, 0, sizeof delay);
+                    delay.type = KS_DELAY;
+                    delay.arg = ks.arg / ck->speed;
+                    if (delay.arg)
+                        queueStroke(ck, &delay);
+                }
+                ks.arg = 0;
+            }
+            else if (ks.type == KS_DELAY) {
+                ks.arg = (ck->speed > 0) ? ks.arg / ck->speed : 0;
+                if (!ks.arg)
+                    continue;
+            }
+            else if (ks.type == KS_WAIT) {
+                if (waitFor(ck, 0) < 0)
+                    break;
+                continue;
+            }
+
+            if (ks.type != KS_DELAY && (!sameKeymap || !ks.keycode)) {
+                int modmask = ks.mods;
+                ks.keycode = lookupKeysym(ck, ks.keysym, &modmask);
+                if (ks.keycode == 0)
+                    ks.keycode = bindSpareKeycode(ck, ks.keysym);
+                ks.modmask = modmask;
+                if (ks.keycode == 0) {
+                    printf("crikey: Can't simulate keysym %ld: no keycode\n",
+                           ks.keysym);
+                    ++ck->stats.failed;
+                    continue;
+                }
+            }
+            queueStroke(ck, &ks);
+        }
+        if (ck->aborted)
+            break;
+        /* A long recording goes out as it's read */
+        flushKeyPresses(ck);
+    }
+    fclose(fp);
+    if (ck->aborted) {
+        ck->aborted = 0;
+        return -1;
+    }
+    flushKeyPresses(ck);
+    return 0;
+}
+
+/* Long enough for a window title in \(wait:window:...\) */
+#define MAXSYMSIZE 256
+
+/* The most a key can be repeated: more is almost certainly a typo */
+#define MAX_REPEAT 100000
+
+/* The longest \(sleep:ms\), an hour, likewise */
+#define MAX_SLEEP 3600000
+
+/* Decode the UTF-8 sequence at s into *ucs.  Returns its length,
+ * 0 if it runs past len, or -1 if it isn't valid UTF-8.
+ */
+static int utf8Decode(const char* s, size_t len, unsigned long* ucs)
+{
+    const unsigned char* u = (const unsigned char*)s;
+    int n, i;
+
+    if (u[0] < 0x80) {
+        *ucs = u[0];
+        return 1;
+    }
+    else if ((u[0] & 0xe0) == 0xc0) {
+        n = 2;
+        *ucs = u[0] & 0x1f;
+    }
+    else if ((u[0] & 0xf0) == 0xe0) {
+        n = 3;
+        *ucs = u[0] & 0x0f;
+    }
+    else if ((u[0] & 0xf8) == 0xf0) {
+        n = 4;
+        *ucs = u[0] & 0x07;
+    }
+    else
+        return -1;
+
+    for (i = 1; i < n; ++i) {
+        if (i >= len)
+            return 0;
+        if ((u[i] & 0xc0) != 0x80)
+            return -1;
+        *ucs = (*ucs << 6) | (u[i] & 0x3f);
+    }
+    if (*ucs < 0x80 || *ucs > 0x10ffff)
+        return -1;
+    return n;
+}
+
+static KeySym unicodeKeysym(unsigned long ucs)
+{
+    /* Latin-1 keysyms are the same as the code points */
+    if ((ucs >= 0x20 && ucs <= 0x7e) || (ucs >= 0xa0 && ucs <= 0xff))
+        return ucs;
+    return 0x01000000 | ucs;
+}
+
+/* The keysym for a single character, from the table mkkeysyms
+ * generated (NonPrintables there if you need to add anything)
+ */
+static KeySym charKeysym(crikey* ck, char ch)
+{
+    KeySym keysym = CharKeysyms[(unsigned char)ch];
+
+    if (ck->debug && keysym == NoSymbol)
+        printf("No keysym for char 0x%x\n", ch & 0xff);
+    return keysym;
+}
+
+/*
+ * Fast path for plain text. Most input is runs of characters with no
+ * escapes, which need none of the parser below: find where the run
+ * ends a word at a time, then queue its keys straight from the
+ * character table.
+ */
+#define BYTES(c) (0x0101010101010101ULL * (unsigned char)(c))
+#define HAS_ZERO_BYTE(w) (((w) - BYTES(1)) & ~(w) & BYTES(0x80))
+
+/* Where the plain run starting at s ends: at the next \ or ^,
+ * or the next byte of a UTF-8 sequence.
+ */
+static const char* plainRunEnd(const char* s, const char* end)
+{
+    uint64_t w;
+
+    while (end - s >= 8) {
+        memcpy(&w, s, sizeof w);
+        if (HAS_ZERO_BYTE(w ^ BYTES('\\')) | HAS_ZERO_BYTE(w ^ BYTES('^'))
+            | (w & BYTES(0x80)))
+            break;
+        s += 8;
+    }
+    while (s < end && *s != '\\' && *s != '^' && !(*s & 0x80))
+        ++s;
+    return s;
+}
+
+/* Where the run of literal text starting at s ends, for pasting:
+ * at the next escape or control character other than newline or tab.
+ * Unless final, a UTF-8 character that may be cut off is left out.
+ */
+static const char* literalRunEnd(const char* s, const char* end, int final)
+{
+    const char* run = s;
+
+    while (run < end && *run != '\\' && *run != '^'
+           && ((unsigned char)*run >= ' ' || *run == '\n' || *run == '\t')
+           && *run != '\177')
+        ++run;
+    if (run == end && !final) {
+        while (run > s && (run[-1] & 0xc0) == 0x80)
+            --run;
+        if (run > s && (run[-1] & 0x80))
+            --run;
+    }
+    return run;
+}
+
+static void resolveChar(crikey* ck, int c)
+{
+    KeySym keysym = c ? charKeysym(ck, c) : NoSymbol;
+    KeyCode keycode = 0;
+    int modmask = 0;
+
+    if (keysym)
+        keycode = lookupKeysym(ck, keysym, &modmask);
+    /* Spare keycode bindings come and go: leave those to
+     * simulateKeyPress every time.
+     */
+    if (ck->isSpare[keycode])
+        keycode = 0;
+    ck->charSyms[c] = keysym;
+    ck->charKeys[c] = keycode;
+    ck->charMods[c] = modmask;
+    ck->charKnown[c] = 1;
+}
+
+static void queuePlainRun(crikey* ck, const char* s, const char* end)
+{
+    KeyStroke* ks;
+    int c;
+
+    if (ck->debug)
+        printf("Plain text: %.*s\n", (int)(end - s), s);
+    if (reserveQueue(ck, end - s) < 0)
+        return;
+    for ( ; s < end; ++s) {
+        c = *s;
+        if (!ck->charKnown[c])
+            resolveChar(ck, c);
+        if (!ck->charKeys[c]) {
+            if (ck->charSyms[c])
+                simulateKeyPress(ck, ck->charSyms[c], 0);
+            continue;
+        }
+        if (ck->queueLen >= ck->queueSize && reserveQueue(ck, end - s) < 0)
+            return;
+        ks = ck->queue + ck->queueLen++;
+        ks->type = KS_KEY;
+        ks->keycode = ck->charKeys[c];
+        ks->modmask = ck->charMods[c];
+        ks->mods = 0;
+        ks->keysym = ck->charSyms[c];
+        ks->arg = 0;
+        if (ck->batchSize > 0 && ck->queueLen >= ck->batchSize)
+            flushKeyPresses(ck);
+    }
+}
+
+/*
+ * Parse len bytes of input and queue the keys.
+ * Input can arrive in pieces (stdin, big files): unless final is set,
+ * a key whose escape sequence runs off the end of the buffer is left
+ * alone, and the return value says how many bytes were used so the
+ * caller can hand the rest back along with the next piece.
+ */
+static size_t simulateKeyPressForBuffer(crikey* ck,
+                                        const char* start, size_t len,
+                                        int final)
+{
+    const char* s = start;
+    const char* end = start + len;
+    const char* unit = start;   /* where the current key's escapes begin */
+    KeySym keysym;
+    char buf[2];
+    char sym[MAXSYMSIZE];
+    char* star;
+    int i, n;
+    int modmask = 0;
+    int cont, escaped, count;
+    int oldphase = setPhase(ck, PH_PARSE);
+
+    while (s < end && !ck->aborted)
+    {
+        /* A long enough run of text can be pasted instead */
+        if (!modmask && ck->pasteSel != None && !ck->programOut) {
+            const char* run = literalRunEnd(s, end, final);
+
+            if (run - s >= ck->pasteMin) {
+                setPhase(ck, oldphase);
+                flushKeyPresses(ck);
+                i = pasteText(ck, s, run - s);
+                setPhase(ck, PH_PARSE);
+                if (i == 0) {
+                    s = run;
+                    continue;
+                }
+                printf("crikey: Typing instead of pasting\n");
+                ck->pasteSel = None;
+            }
+        }
+
+        /* Plain text goes through the character table a run at a time */
+        if (!modmask && ck->fastPath) {
+            const char* run = plainRunEnd(s, end);
+
+            if (run > s) {
+                queuePlainRun(ck, s, run);
+                s = run;
+                continue;
+            }
+        }
+
+        cont = 0;
+        keysym = 0;
+        escaped = 0;
+        count = 1;
+        if (!modmask)
+            unit = s;
+        if ((*s == '\\' || *s == '^') && s+1 >= end && !final)
+            break;
+        if (*s == '\\' && s+1 < end) {
+            escaped = 1;
+            switch (*(++s))
+            {
+              case '\\':
+                  buf[0] = '\\';
+                  break;
+              case 'S':
+                  modmask |= ShiftMask;
+                  cont = 1;
+                  break;
+              case 'C':
+                  modmask |= ControlMask;
+                  cont = 1;
+                  if (ck->debug) printf("C- control char\n");
+                  break;
+              case 'A':
+                  modmask |= Mod1Mask;
+                  cont = 1;
+                  break;
+              case 'M':
+              case 'W':
+                  modmask |= Mod4Mask;
+                  cont = 1;
+                  break;
+              case 'n':
+                  buf[0] = '\n';
+                  break;
+              case 'r':
+                  buf[0] = '\r';
+                  break;
+              case 't':
+                  buf[0] = '\t';
+                  break;
+              case 'b':
+                  buf[0] = '\010';
+                  break;
+              case 'd':
+                  buf[0] = '\177';
+                  break;
+              case 'e':
+                  buf[0] = '\27';
+                  break;
+              case '0':  case '1':  case '2':  case '3':  case '4':
+              case '5':  case '6':  case '7':  case '8':  case '9':
+                  for (n = 0; s < end && isdigit(s[0]); ++s)
+                      n = n * 10 + s[0] - '0';
+                  if (s >= end && !final) {
+                      setPhase(ck, oldphase);
+                      return unit - start;
+                  }
+                  buf[0] = n;
+                  if (ck->debug) printf("Numeric character %d\n", n);
+                  --s;
+                  break;
+              case '(':
+                  /* parse a symbolic name */
+                  for (i=0, ++s;
+                       i < MAXSYMSIZE-1 && s < end
+                       && !(s[0] == '\\' && s+1 < end && s[1] == ')');
+                       ++i, ++s) {
+                      sym[i] = *s;
+                  }
+                  if (s >= end) {
+                      if (!final && i < MAXSYMSIZE-1) {
+                          setPhase(ck, oldphase);
+                          return unit - start;
+                      }
+                      --s;    /* unterminated: stop at the end */
+                  }
+
+                  sym[i] = '\0';
+                  buf[0] = 0;
+                  ++s;
+                  if (!strncmp(sym, "sleep:", 6)) {
+                      KeyStroke delay;
+                      char* num_end;
+                      long msec;
+
+                      errno = 0;
+                      msec = strtol(sym + 6, &num_end, 10);
+                      memset(&delay, 0, sizeof delay);
+                      delay.type = KS_DELAY;
+                      if (num_end == sym + 6 || *num_end || msec < 0)
+                          printf("crikey: Can't sleep for %s ms\n", sym + 6);
+                      else if (msec > MAX_SLEEP || errno == ERANGE) {
+                          printf("crikey: Can't sleep more than %d ms\n",
+                                 MAX_SLEEP);
+                          delay.arg = MAX_SLEEP;
+                      }
+                      else
+                          delay.arg = msec;
+                      if (delay.arg)
+                          queueStroke(ck, &delay);
+                      ++s;
+                      modmask = 0;
+                      continue;
+                  }
+                  if (!strncmp(sym, "wait:", 5)) {
+                      setPhase(ck, oldphase);
+                      i = simulateWait(ck, sym + 5);
+                      setPhase(ck, PH_PARSE);
+                      /* If it timed out, don't type the rest */
+                      s = (i < 0) ? end : s + 1;
+                      modmask = 0;
+                      continue;
+                  }
+
+                  /* \(BackSpace*500\): a repeat count */
+                  star = strrchr(sym, '*');
+                  if (star && star > sym && star[1]
+                      && strspn(star + 1, "0123456789") == strlen(star + 1)) {
+                      count = (strlen(star + 1) > 6) ? MAX_REPEAT + 1
+                                                     : atoi(star + 1);
+                      *star = '\0';
+                  }
+
+                  /* keysym is in sym; parse it now */
+                  keysym = stringToKeysym(ck, sym);
+                  if (ck->debug) {
+                      printf("Found symbol '%s' ...", sym);
+                      printf("which has keysym %lu ", keysym);
+                      printf("and keycode %d\n",
+                             (unsigned)lookupKeysym(ck, keysym, 0));
+                  }
+                  break;
+              default:
+                  --s;
+                  buf[0] = '\\';
+                  escaped = 0;
+                  break;
+            }
+        }
+        else if (s[0] == '^' && s+1 < end) {
+            if (s[1] == '^') {
+                buf[0] = '^';
+                ++s;
+            }
+            else if (isalpha(s[1])) {
+                /* Control character: send the letter along with ControlMask */
+                if (ck->debug) printf("Control character\n");
+                modmask |= ControlMask;
+                if (isupper(s[1]))
+                    buf[0] = s[1] - 'A' + 'a';
+                else
+                    buf[0] = s[1];
+                if (ck->debug) printf("Control character ^%c = %d\n", s[1], buf[0]);
+                ++s;
+            }
+            else
+                buf[0] = '^';
+        }
+        else if (*s & 0x80) {
+            /* UTF-8: the character's Unicode keysym */
+            unsigned long ucs;
+            int ulen = utf8Decode(s, end - s, &ucs);
+
+            if (ulen == 0 && !final)
+                break;
+            buf[0] = 0;
+            if (ulen <= 0) {
+                if (ck->debug) printf("Bad UTF-8 byte 0x%x\n", *s & 0xff);
+            }
+            else {
+                keysym = unicodeKeysym(ucs);
+                if (ck->debug) printf("Unicode U+%04lX\n", ucs);
+                s += ulen - 1;
+            }
+        }
+        else {
+            if (ck->debug) printf("character '%c'\n", buf[0]);
+            buf[0] = *s;
+        }
+
+        /* If cont is set, then we've only gotten modifiers
+         * and need to loop around again to get the actual character.
+         */
+        if (cont) {
+            ++s;
+            continue;
+        }
+
+        if (!keysym && buf[0] != 0) {
+            buf[1] = '\0';
+
+            /* Evil special cases */
+
+            /* Ctrl-D has to be sent as a control and a d,
+             * not an EOF character.
+             */
+#if 0
+            if (buf[0] == 4) {   /* ctrl-d */
+                modmask |= ControlMask;
+                buf[0] = 'd';
+            }
+            else if (buf[0] == 12) {   /* ctrl-l */
+                modmask |= ControlMask;
+                buf[0] = 'l';
+            }
+#endif
+
+            keysym = charKeysym(ck, buf[0]);
+        }
+
+        /* A count after an escaped or modified key, \t{20}, repeats
+         * it. After plain text, braces are just braces.
+         */
+        if (modmask)
+            escaped = 1;
+        if (escaped && s+1 >= end && !final) {
+            setPhase(ck, oldphase);
+            return unit - start;
+        }
+        if (escaped && s+1 < end && s[1] == '{') {
+            const char* c;
+
+            for (n = 0, c = s + 2; c < end && isdigit(*c); ++c)
+                if (n <= MAX_REPEAT)
+                    n = n * 10 + *c - '0';
+            if (c >= end && !final) {
+                setPhase(ck, oldphase);
+                return unit - start;
+            }
+            if (c < end && *c == '}' && c > s + 2) {
+                count = n;
+                s = c;
+            }
+        }
+        if (count > MAX_REPEAT) {
+            printf("crikey: Can't repeat a key more than %d times\n",
+                   MAX_REPEAT);
+            count = MAX_REPEAT;
+        }
+
+        if (keysym)
+            simulateKeyRepeat(ck, keysym, modmask, count);
+        else if (ck->debug) {
+            printf("crikey: Can't simulate key '%s'\n", buf);
+        }
+
+        ++s;
+        modmask = 0;
+    }
+
+    setPhase(ck, oldphase);
+    /* Modifiers with no key yet: wait for the key */
+    if (modmask && !final)
+        return unit - start;
+    return (s < end ? s : end) - start;
+}
+
+static void simulateKeyPressForString(crikey* ck, const char* s)
+{
+    simulateKeyPressForBuffer(ck, s, strlen(s), 1);
+}
+
+/*
+ * Type everything read from fd, sending each chunk as it comes in.
+ * An escape split across two reads is carried over to the next one.
+ *
+ * Reading happens on a thread of its own, into a ring buffer, so a
+ * producer writing into the pipe isn't held up while we wait for the
+ * server: the ring keeps filling during an XSync or a paced run, and
+ * the next parse takes everything that came in meanwhile. There's one
+ * reader and one consumer, so the ring needs no lock, just the two
+ * positions. Whoever finds it empty (or full) sleeps on a pipe the
+ * other side writes a byte to after moving its position.
+ * Parsing stays on this thread with the sending: resolving keys can
+ * bind spare keycodes, paste or wait, all of which talk to the server.
+ */
+#define RING_SIZE (1 << 20)     /* a power of 2, at least 2 * BUFSIZE */
+
+typedef struct {
+    int fd;
+    char* ring;
+    atomic_size_t head;         /* written by the reader */
+    atomic_size_t tail;         /* written by the consumer */
+    atomic_int eof;
+    int dataPipe[2];            /* reader -> consumer: there's more */
+    int spacePipe[2];           /* consumer -> reader: there's room */
+    pthread_t thread;
+} StreamReader;
+
+/* Wake the other side; if its pipe is full, it's awake already */
+static void wakeUp(int fd)
+{
+    char c = 0;
+
+    if (write(fd, &c, 1) < 0 && errno != EAGAIN)
+        perror("crikey: write");
+}
+
+/* Empty a wakeup pipe, before looking again at what woke us */
+static void drainPipe(int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof buf) > 0)
+        ;
+}
+
+static void* readerThread(void* arg)
+{
+    StreamReader* r = arg;
+    size_t head = 0, tail, room;
+    ssize_t n;
+    fd_set fds;
+
+    for (;;) {
+        tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head - tail == RING_SIZE) {
+            /* Full: wait for the consumer to take some */
+            drainPipe(r->spacePipe[0]);
+            if (atomic_load_explicit(&r->tail, memory_order_acquire)
+                != tail)
+                continue;
+            FD_ZERO(&fds);
+            FD_SET(r->spacePipe[0], &fds);
+            select(r->spacePipe[0] + 1, &fds, 0, 0, 0);
+            continue;
+        }
+        /* As much as fits before the end of the ring */
+        room = RING_SIZE - (head - tail);
+        if (room > RING_SIZE - (head & (RING_SIZE - 1)))
+            room = RING_SIZE - (head & (RING_SIZE - 1));
+        if (room > BUFSIZE)
+            room = BUFSIZE;
+        n = read(r->fd, r->ring + (head & (RING_SIZE - 1)), room);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            perror("crikey: read");
+        if (n <= 0) {
+            atomic_store_explicit(&r->eof, 1, memory_order_release);
+            wakeUp(r->dataPipe[1]);
+            return 0;
+        }
+        head += n;
+        atomic_store_explicit(&r->head, head, memory_order_release);
+        wakeUp(r->dataPipe[1]);
+    }
+}
+
+static int startReader(StreamReader* r, int fd)
+{
+    sigset_t all, old;
+    int ok;
+
+    memset(r, 0, sizeof *r);
+    r->fd = fd;
+    r->ring = malloc(RING_SIZE);
+    if (!r->ring)
+        return -1;
+    if (pipe(r->dataPipe) < 0) {
+        free(r->ring);
+        return -1;
+    }
+    if (pipe(r->spacePipe) < 0) {
+        close(r->dataPipe[0]);
+        close(r->dataPipe[1]);
+        free(r->ring);
+        return -1;
+    }
+    fcntl(r->dataPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(r->dataPipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(r->spacePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(r->spacePipe[1], F_SETFL, O_NONBLOCK);
+    /* Signals go to the thread that's typing, so a read here doesn't
+     * swallow one the caller means to stop us with
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ok = pthread_create(&r->thread, 0, readerThread, r);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    if (ok != 0) {
+        close(r->dataPipe[0]);
+        close(r->dataPipe[1]);
+        close(r->spacePipe[0]);
+        close(r->spacePipe[1]);
+        free(r->ring);
+        return -1;
+    }
+    return 0;
+}
+
+static void stopReader(StreamReader* r)
+{
+    /* The reader may be blocked reading; we're done with the input */
+    pthread_cancel(r->thread);
+    pthread_join(r->thread, 0);
+    close(r->dataPipe[0]);
+    close(r->dataPipe[1]);
+    close(r->spacePipe[0]);
+    close(r->spacePipe[1]);
+    free(r->ring);
+}
+
+/* Take up to max bytes from the ring into buf, waiting if it's empty,
+ * and handling X events (keyboard map changes) while we wait.
+ * Returns 0 at end of file.
+ */
+static ssize_t takeFromRing(crikey* ck, StreamReader* r, char* buf,
+                            size_t max)
+{
+    size_t head, n, first;
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    int xfd = ck->disp ? ConnectionNumber(ck->disp) : -1;
+    fd_set fds;
+
+    for (;;) {
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (head != tail)
+            break;
+        if (stopping(ck))
+            return 0;
+        if (atomic_load_explicit(&r->eof, memory_order_acquire)) {
+            /* It may have put more in before it got to the end */
+            if (atomic_load_explicit(&r->head, memory_order_acquire)
+                == tail)
+                return 0;
+            continue;
+        }
+        drainPipe(r->dataPipe[0]);
+        if (atomic_load_explicit(&r->head, memory_order_acquire) != tail
+            || atomic_load_explicit(&r->eof, memory_order_acquire))
+            continue;
+        FD_ZERO(&fds);
+        FD_SET(r->dataPipe[0], &fds);
+        if (xfd >= 0)
+            FD_SET(xfd, &fds);
+        if (select((xfd > r->dataPipe[0] ? xfd : r->dataPipe[0]) + 1,
+                   &fds, 0, 0, 0) > 0 && xfd >= 0 && FD_ISSET(xfd, &fds))
+            handlePendingEvents(ck);
+    }
+
+    n = head - tail;
+    if (n > max)
+        n = max;
+    first = RING_SIZE - (tail & (RING_SIZE - 1));
+    if (first > n)
+        first = n;
+    memcpy(buf, r->ring + (tail & (RING_SIZE - 1)), first);
+    memcpy(buf + first, r->ring, n - first);
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    wakeUp(r->spacePipe[1]);
+    return n;
+}
+
+static void simulateKeyPressForStream(crikey* ck, int fd)
+{
+    StreamReader reader;
+    char* buf = malloc(2 * BUFSIZE);
+    size_t have = 0, used;
+    ssize_t n;
+    int final = 0;
+    int threaded;
+
+    if (!buf) {
+        outOfMemory(ck);
+        return;
+    }
+    /* Without a thread, just read as we go */
+    threaded = (startReader(&reader, fd) == 0);
+
+    while (!final && !stopping(ck)) {
+        if (threaded)
+            n = takeFromRing(ck, &reader, buf + have, BUFSIZE);
+        else {
+            n = read(fd, buf + have, BUFSIZE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                perror("crikey: read");
+        }
+        final = (n <= 0);
+        if (n > 0)
+            have += n;
+
+        handlePendingEvents(ck);
+        used = simulateKeyPressForBuffer(ck, buf, have, final);
+        /* If a whole buffer isn't a complete key, it never will be */
+        if (used == 0 && have >= BUFSIZE)
+            used = simulateKeyPressForBuffer(ck, buf, have, 1);
+        flushKeyPresses(ck);
+        memmove(buf, buf + used, have - used);
+        have -= used;
+    }
+    if (threaded)
+        stopReader(&reader);
+    free(buf);
+}
+
+/* Type a whole file, mapping it rather than copying it in. */
+static int simulateKeyPressForFile(crikey* ck, const char* filename)
+{
+    struct stat st;
+    const char* data;
+    size_t off, used, len;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        perror(filename);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+        || (data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+            == MAP_FAILED) {
+        /* A pipe or something else we can't map: just read it */
+        simulateKeyPressForStream(ck, fd);
+        close(fd);
+        return 0;
+    }
+    madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+    /* Go a piece at a time so the queue stays small */
+    for (off = 0; off < st.st_size && !ck->aborted; off += used) {
+        len = st.st_size - off;
+        if (len > BUFSIZE)
+            len = BUFSIZE;
+        handlePendingEvents(ck);
+        used = simulateKeyPressForBuffer(ck, data + off, len,
+                                         off + len >= st.st_size);
+        if (used == 0)      /* no complete key in a whole piece */
+            used = simulateKeyPressForBuffer(ck, data + off, len, 1);
+        flushKeyPresses(ck);
+    }
+
+    munmap((void*)data, st.st_size);
+    close(fd);
+    return 0;
+}
+
+/*
+ * Snippet library (-k name): named strings kept in a file, one per
+ * line, as "name text", where text uses the usual crikey escapes.
+ * Blank lines and lines starting with # are ignored.
+ *
+ * Next to the file is an index, file.idx: a hash table of names with
+ * the offset and length of each snippet's text. It is mapped rather
+ * than read, so looking a name up touches a page or two of it however
+ * big the library gets. The index is rebuilt whenever the snippet
+ * file's size or modification time no longer matches the ones it
+ * records. If it can't be written (the library is in a read-only
+ * directory, say), the file is searched from start to end instead.
+ */
+#define INDEX_MAGIC "CRKYIDX1"
+
+typedef struct {
+    char magic[8];
+    uint32_t nbuckets;      /* a power of 2 */
+    uint32_t nsnippets;
+    int64_t srcsize;        /* the snippet file this was built from */
+    int64_t srcmtime;       /* in nanoseconds */
+} IndexHeader;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t namelen;       /* 0 if the bucket is empty */
+    uint32_t nameoff;       /* where the name is in the snippet file */
+    uint32_t textoff;
+    uint32_t textlen;
+} IndexEntry;
+
+static uint32_t nameHash(const char* name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len--)
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    return hash;
+}
+
+static char* snippetFile(void)
+{
+    static char path[PATH_MAX];
+    char* home = getenv("HOME");
+
+    snprintf(path, sizeof path, "%s/.crikey-snippets", home ? home : ".");
+    return path;
+}
+
+static int64_t fileTime(const struct stat* st)
+{
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/* The next snippet in data, starting at *off: sets where its name
+ * and text are and how long they are, and moves *off past its line.
+ * Returns 0 when there are no more.
+ */
+static int nextSnippet(const char* data, size_t size, size_t* off,
+                       size_t* name, size_t* namelen,
+                       size_t* text, size_t* textlen)
+{
+    size_t p, eol;
+
+    for (p = *off; p < size; p = eol + 1) {
+        for (eol = p; eol < size && data[eol] != '\n'; ++eol)
+            ;
+        if (eol == p || data[p] == '#' || isspace((unsigned char)data[p]))
+            continue;
+        for (*name = p; p < eol && !isspace((unsigned char)data[p]); ++p)
+            ;
+        *namelen = p - *name;
+        for (; p < eol && isblank(data[p]); ++p)
+            ;
+        *text = p;
+        *textlen = eol - p;
+        *off = eol + 1;
+        return 1;
+    }
+    *off = size;
+    return 0;
+}
+
+/* Index the snippet file (already open as fd) into idxname.
+ * Written to a temporary file then renamed, so a hotkey running
+ * at the same time sees either the old index or the new one.
+ * If it can't be, that's not an error: the caller does without.
+ */
+static int buildSnippetIndex(int fd, const struct stat* st,
+                             const char* idxname)
+{
+    IndexHeader hdr;
+    IndexEntry* table;
+    const char* data;
+    size_t off, n = 0, nbuckets = 16;
+    size_t name, namelen, text, textlen;
+    char tmpname[PATH_MAX];
+    int ifd;
+
+    /* The offsets in the index are 32 bits */
+    if (st->st_size >= UINT32_MAX)
+        return -1;
+    data = st->st_size ? mmap(0, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                       : "";
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    /* Size the table for a load of at most one half */
+    for (off = 0; off < st->st_size; ++off)
+        if (data[off] == '\n')
+            ++n;
+    while (nbuckets < 2 * (n + 1))
+        nbuckets *= 2;
+    table = calloc(nbuckets, sizeof *table);
+    if (!table) {
+        printf("crikey: Out of memory\n");
+        if (st->st_size)
+            munmap((void*)data, st->st_size);
+        return -1;
+    }
+
+    n = 0;
+    off = 0;
+    while (nextSnippet(data, st->st_size, &off,
+                       &name, &namelen, &text, &textlen)) {
+        uint32_t hash;
+        IndexEntry* e;
+
+        /* The first definition of a name wins */
+        hash = nameHash(data + name, namelen);
+        for (e = table + (hash & (nbuckets-1)); e->namelen;
+             e = table + ((e - table + 1) & (nbuckets-1)))
+            if (e->hash == hash && e->namelen == namelen
+                && !memcmp(data + e->nameoff, data + name, namelen))
+                break;
+        if (e->namelen)
+            continue;
+        e->hash = hash;
+        e->namelen = namelen;
+        e->nameoff = name;
+        e->textoff = text;
+        e->textlen = textlen;
+        ++n;
+    }
+    if (st->st_size)
+        munmap((void*)data, st->st_size);
+
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof hdr.magic);
+    hdr.nbuckets = nbuckets;
+    hdr.nsnippets = n;
+    hdr.srcsize = st->st_size;
+    hdr.srcmtime = fileTime(st);
+
+    if (snprintf(tmpname, sizeof tmpname, "%s.XXXXXX", idxname)
+        >= sizeof tmpname)
+        ifd = -1;
+    else
+        ifd = mkstemp(tmpname);
+    if (ifd < 0
+        || write(ifd, &hdr, sizeof hdr) != sizeof hdr
+        || write(ifd, table, nbuckets * sizeof *table)
+           != nbuckets * sizeof *table
+        || close(ifd) != 0
+        || rename(tmpname, idxname) != 0) {
+        if (ifd >= 0)
+            unlink(tmpname);
+        free(table);
+        return -1;
+    }
+    free(table);
+    return 0;
+}
+
+/* Look for name in a mapped index; returns its entry or 0 */
+static const IndexEntry* findSnippet(const char* index, int fd,
+                                     const char* name)
+{
+    const IndexHeader* hdr = (const IndexHeader*)index;
+    const IndexEntry* table = (const IndexEntry*)(hdr + 1);
+    size_t namelen = strlen(name);
+    uint32_t hash = nameHash(name, namelen);
+    uint32_t i, mask = hdr->nbuckets - 1;
+    size_t off, len;
+    char buf[256];
+
+    for (i = hash & mask; table[i].namelen; i = (i + 1) & mask) {
+        if (table[i].hash != hash || table[i].namelen != namelen)
+            continue;
+        /* Compare the names, a buffer at a time */
+        for (off = 0; off < namelen; off += len) {
+            len = namelen - off;
+            if (len > sizeof buf)
+                len = sizeof buf;
+            if (pread(fd, buf, len, table[i].nameoff + off) != len
+                || memcmp(buf, name + off, len))
+                break;
+        }
+        if (off >= namelen)
+            return table + i;
+    }
+    return 0;
+}
+
+/* Without an index: go through the whole file for name.
+ * Returns -1 if it isn't there, else 0 with its text, malloced, in *text.
+ */
+static int scanSnippets(int fd, const struct stat* st, const char* name,
+                        char** text)
+{
+    const char* data;
+    size_t off = 0, nm, namelen, txt, textlen;
+    size_t len = strlen(name);
+    int ret = -1;
+
+    *text = 0;
+    if (st->st_size == 0)
+        return -1;
+    data = mmap(0, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    while (nextSnippet(data, st->st_size, &off,
+                       &nm, &namelen, &txt, &textlen)) {
+        if (namelen != len || memcmp(data + nm, name, len))
+            continue;
+        *text = malloc(textlen + 1);
+        if (*text) {
+            memcpy(*text, data + txt, textlen);
+            (*text)[textlen] = '\0';
+        }
+        else
+            printf("crikey: Out of memory\n");
+        ret = 0;
+        break;
+    }
+    munmap((void*)data, st->st_size);
+    return ret;
+}
+
+/* Find the snippet called name in filename (0 for ~/.crikey-snippets),
+ * building or rebuilding its index if need be.
+ * Returns the snippet's text, malloced, or 0 if it isn't there.
+ */
+char* crikey_load_snippet(const char* filename, const char* name)
+{
+    char idxname[PATH_MAX];
+    struct stat st, ist;
+    const IndexHeader* hdr;
+    const IndexEntry* e;
+    char* index = MAP_FAILED;
+    char* text = 0;
+    int fd, ifd = -1, tries;
+
+    if (!filename)
+        filename = snippetFile();
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    if (snprintf(idxname, sizeof idxname, "%s.idx", filename)
+        >= sizeof idxname) {
+        printf("crikey: %s: name too long\n", filename);
+        close(fd);
+        return 0;
+    }
+
+    for (tries = 0; tries < 2; ++tries) {
+        ifd = open(idxname, O_RDONLY);
+        if (ifd >= 0 && fstat(ifd, &ist) == 0
+            && ist.st_size >= sizeof *hdr)
+            index = mmap(0, ist.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+        if (index != MAP_FAILED) {
+            hdr = (const IndexHeader*)index;
+            if (!memcmp(hdr->magic, INDEX_MAGIC, sizeof hdr->magic)
+                && hdr->nbuckets
+                && !(hdr->nbuckets & (hdr->nbuckets - 1))
+                && ist.st_size == sizeof *hdr
+                                  + hdr->nbuckets * sizeof(IndexEntry)
+                && hdr->srcsize == st.st_size
+                && hdr->srcmtime == fileTime(&st))
+                break;
+            munmap(index, ist.st_size);
+            index = MAP_FAILED;
+        }
+        if (ifd >= 0)
+            close(ifd);
+        ifd = -1;
+        if (tries == 0 && buildSnippetIndex(fd, &st, idxname) < 0)
+            break;
+    }
+    if (index == MAP_FAILED) {
+        if (scanSnippets(fd, &st, name, &text) < 0)
+            printf("crikey: No snippet called %s in %s\n", name, filename);
+        close(fd);
+        return text;
+    }
+
+    e = findSnippet(index, fd, name);
+    if (e) {
+        text = malloc(e->textlen + 1);
+        if (!text || pread(fd, text, e->textlen, e->textoff) != e->textlen) {
+            printf("crikey: Can't read snippet %s\n", name);
+            free(text);
+            text = 0;
+        }
+        else
+            text[e->textlen] = '\0';
+    }
+    else
+        printf("crikey: No snippet called %s in %s\n", name, filename);
+
+    munmap(index, ist.st_size);
+    close(ifd);
+    close(fd);
+    return text;
+}
+
+/*
+ * Recording (--record file): real key presses and releases, captured
+ * with the RECORD extension and written as a crikey program, so
+ * --play replays them (--speed to change the pace). Each record is a
+ * KS_PRESS or KS_RELEASE with the milliseconds since the previous one
+ * in arg, so it costs one buffered fwrite per key event.
+ *
+ * Events are held back until no keys are down, so the chord that
+ * stops the recording (Control-C) isn't part of it.
+ */
+typedef struct {
+    crikey* ck;
+    FILE* out;
+    ProgramRecord pending[64];
+    int numPending;
+    char keyDown[256];
+    int numDown;
+    Time lastTime;
+} Recording;
+
+static void recordCallback(XPointer closure, XRecordInterceptData* d)
+{
+    Recording* r = (Recording*)closure;
+    crikey* ck = r->ck;
+    ProgramRecord* rec;
+    int type, keycode;
+
+    if (d->category != XRecordFromServer || d->data_len < 1) {
+        XRecordFreeData(d);
+        return;
+    }
+    type = d->data[0] & 0x7f;
+    keycode = d->data[1];
+
+    if (r->numPending >= sizeof r->pending / sizeof *r->pending) {
+        fwrite(r->pending, sizeof *r->pending, r->numPending, r->out);
+        r->numPending = 0;
+    }
+    rec = r->pending + r->numPending++;
+    rec->type = (type == KeyPress) ? KS_PRESS : KS_RELEASE;
+    rec->keycode = keycode;
+    rec->modmask = rec->mods = 0;
+    rec->keysym = (keycode >= ck->minKeycode && keycode <= ck->maxKeycode)
+        ? ck->keymapSyms[(keycode - ck->minKeycode) * ck->keysymsPer]
+        : NoSymbol;
+    rec->arg = r->lastTime ? d->server_time - r->lastTime : 0;
+    r->lastTime = d->server_time;
+    if (ck->debug)
+        printf("Recorded %s of keycode %d after %u ms\n",
+               type == KeyPress ? "press" : "release", keycode, rec->arg);
+
+    if (type == KeyPress && !r->keyDown[keycode]) {
+        r->keyDown[keycode] = 1;
+        ++r->numDown;
+    }
+    else if (type == KeyRelease && r->keyDown[keycode]) {
+        r->keyDown[keycode] = 0;
+        --r->numDown;
+    }
+    if (r->numDown == 0) {
+        fwrite(r->pending, sizeof *r->pending, r->numPending, r->out);
+        r->numPending = 0;
+    }
+    XRecordFreeData(d);
+}
+
+/* How often recording looks at *stop when no keys come, in ms */
+#define RECORD_POLL 100
+
+int crikey_record(crikey* ck, const char* filename,
+                  volatile sig_atomic_t* stop)
+{
+    XRecordClientSpec clients = XRecordAllClients;
+    XRecordRange* range = 0;
+    XRecordContext ctx = 0;
+    Display* data;
+    ProgramHeader hdr;
+    Recording r;
+    int major, minor, fd, ret = -1;
+    struct timeval tv;
+    fd_set fds;
+
+    if (!ck->disp) {
+        printf("crikey: Recording needs an X server\n");
+        return -1;
+    }
+    if (!XRecordQueryVersion(ck->disp, &major, &minor)) {
+        printf("crikey: The X server doesn't have the RECORD extension\n");
+        return -1;
+    }
+    /* Recorded events come in on a connection of their own */
+    data = XOpenDisplay(DisplayString(ck->disp));
+    if (!data) {
+        printf("crikey: Can't open display %s\n", DisplayString(ck->disp));
+        return -1;
+    }
+    memset(&r, 0, sizeof r);
+    r.ck = ck;
+    r.out = fopen(filename, "wb");
+    if (!r.out) {
+        perror(filename);
+        goto done;
+    }
+    memcpy(hdr.magic, PROGRAM_MAGIC, sizeof hdr.magic);
+    hdr.keymapHash = ck->keymapHash;
+    hdr.reserved = 0;
+    fwrite(&hdr, sizeof hdr, 1, r.out);
+
+    range = XRecordAllocRange();
+    if (!range) {
+        printf("crikey: Out of memory\n");
+        goto done;
+    }
+    range->device_events.first = KeyPress;
+    range->device_events.last = KeyRelease;
+    ctx = XRecordCreateContext(ck->disp, 0, &clients, 1, &range, 1);
+    XSync(ck->disp, False);
+    if (!ctx || !XRecordEnableContextAsync(data, ctx, recordCallback,
+                                             (XPointer)&r)) {
+        printf("crikey: Can't start recording\n");
+        goto done;
+    }
+
+    /* We don't know what sets *stop, so we can't block its signal
+     * until select: a signal just after we look would be lost, and
+     * we'd sit there until the next key. Look again every so often.
+     */
+    fd = ConnectionNumber(data);
+    while (!*stop) {
+        XRecordProcessReplies(data);
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        tv.tv_sec = 0;
+        tv.tv_usec = RECORD_POLL * 1000;
+        if (select(fd + 1, &fds, 0, 0, &tv) < 0 && errno != EINTR) {
+            perror("select");
+            break;
+        }
+    }
+
+    XRecordDisableContext(ck->disp, ctx);
+    ret = 0;
+
+done:
+    if (ctx)
+        XRecordFreeContext(ck->disp, ctx);
+    XSync(ck->disp, False);
+    if (range)
+        XFree(range);
+    XCloseDisplay(data);
+    if (r.out && fclose(r.out) != 0) {
+        perror(filename);
+        ret = -1;
+    }
+    return ret;
+}
+
+
+/*
+ * The rest of the library interface (see crikey.h).
+ */
+void crikey_default_options(crikey_options* opts)
+{
+    memset(opts, 0, sizeof *opts);
+    opts->backend = CRIKEY_XTEST;
+    opts->speed = 1.0;
+}
+
+/* Open a display and get ready to send to it: see whether it has
+ * XTest, and build the keymap cache.
+ */
+static int openDisplay(crikey* ck, const char* name)
+{
+    int op, ev, er;
+
+    ck->disp = XOpenDisplay(name);
+    if (!ck->disp) {
+        printf("crikey: Can't open display %s\n", XDisplayName(name));
+        return -1;
+    }
+
+#ifdef HAVE_XCB
+    if (ck->useXCB) {
+        ck->useXTest = ck->useXCB = buildKeymapCacheXCB(ck);
+        return 0;
+    }
+#endif
+    if (ck->useXTest) {
+        ck->useXTest = XQueryExtension(ck->disp, "XTEST", &op, &ev, &er);
+        ++ck->stats.requests;
+        ++ck->stats.roundtrips;
+    }
+    buildKeymapCache(ck);
+    return 0;
+}
+
+crikey* crikey_open(const char* display, const crikey_options* opts)
+{
+    crikey_options defaults;
+    crikey* ck;
+
+    if (!opts) {
+        crikey_default_options(&defaults);
+        opts = &defaults;
+    }
+    ck = calloc(1, sizeof *ck);
+    if (!ck) {
+        printf("crikey: Out of memory\n");
+        return 0;
+    }
+    memcpy(ck->modifiers, DefaultModifiers, sizeof ck->modifiers);
+    ck->uinputFd = -1;
+    ck->traceSep = "";
+
+    ck->useUinput = (opts->backend == CRIKEY_UINPUT);
+    ck->useNull = (opts->backend == CRIKEY_NULL);
+    ck->stats.eventhash = 2166136261u;
+    ck->useXTest = (opts->backend == CRIKEY_XTEST
+                    || opts->backend == CRIKEY_XCB);
+#ifdef HAVE_XCB
+    ck->useXCB = (opts->backend == CRIKEY_XCB);
+#else
+    if (opts->backend == CRIKEY_XCB)
+        printf("crikey: Built without XCB; using XTest\n");
+#endif
+    ck->useRootWin = opts->root_window;
+    ck->batchSize = opts->batch_size;
+    ck->rate = opts->rate;
+    ck->adaptive = opts->adaptive;
+    ck->speed = opts->speed;
+    ck->waitTimeout = opts->wait_timeout ? opts->wait_timeout
+                                         : WAIT_TIMEOUT;
+    ck->debug = opts->debug;
+    ck->stop = opts->stop;
+    ck->fastPath = !getenv("CRIKEY_NO_FAST_PATH");
+    if (ck->adaptive && !ck->rate)
+        ck->rate = 100;
+    ck->pasteMin = opts->paste_min ? opts->paste_min : 32;
+
+    if ((opts->stats || opts->trace_file)
+        && startStats(ck, opts->trace_file) < 0) {
+        free(ck);
+        return 0;
+    }
+
+    if (ck->useUinput || ck->useNull) {
+        if (ck->adaptive) {
+            printf("crikey: Adaptive pacing needs an X server;"
+                   " using a fixed rate\n");
+            ck->adaptive = 0;
+        }
+        if (ck->useUinput && openUinput(ck, opts->uinput_file) < 0) {
+            crikey_close(ck);
+            return 0;
+        }
+        /* With no X server, keys resolve on a US layout */
+        buildUinputKeymap(ck);
+    }
+    else if (openDisplay(ck, display) < 0) {
+        crikey_close(ck);
+        return 0;
+    }
+
+    if (opts->paste && !ck->disp)
+        printf("crikey: Pasting needs an X server; typing instead\n");
+    else if (opts->paste) {
+        /* Resolve the chord now, so pasting needn't parse anything */
+        ck->batchSize = 0;
+        simulateKeyPressForString(ck, opts->paste_keys ? opts->paste_keys
+                                                       : "\\Cv");
+        ck->batchSize = opts->batch_size;
+        ck->chordKeys = ck->queue;
+        ck->numChordKeys = ck->queueLen;
+        ck->queue = 0;
+        ck->queueLen = ck->queueSize = 0;
+        if (ck->numChordKeys == 0)
+            printf("crikey: No paste keys; typing instead\n");
+        else if (initPaste(ck) < 0)
+            printf("crikey: Can't set up pasting; typing instead\n");
+        else
+            ck->pasteSel = (opts->paste == CRIKEY_PRIMARY)
+                           ? XA_PRIMARY : ck->atoms[A_CLIPBOARD];
+    }
+
+    if (opts->num_windows || opts->window_match) {
+        if (!ck->disp)
+            printf("crikey: Sending to windows needs an X server\n");
+        else {
+            int i;
+
+            for (i = 0; i < opts->num_windows; ++i)
+                addTarget(ck, opts->windows[i]);
+            if (opts->window_match)
+                matchWindows(ck, opts->window_match);
+            if (ck->numTargets == 0) {
+                printf("crikey: No windows match %s\n", opts->window_match);
+                crikey_close(ck);
+                return 0;
+            }
+            /* Only XSendEvent can pick the window */
+            ck->useXTest = ck->useXCB = 0;
+            if (ck->debug)
+                printf("Sending to %d windows\n", ck->numTargets);
+        }
+    }
+
+    /* Something above ran out of memory */
+    if (ck->aborted) {
+        crikey_close(ck);
+        return 0;
+    }
+
+    if (ck->debug) {
+        if (ck->useUinput)
+            printf("Using uinput\n");
+        else if (ck->useNull)
+            printf("Not sending anything\n");
+        else if (ck->useXCB)
+            printf("Using XTest Extension through XCB\n");
+        else if (ck->useXTest)
+            printf("Using XTest Extension\n");
+        else
+            printf("Using XSendEvent\n");
+    }
+    return ck;
+}
+
+void crikey_close(crikey* ck)
+{
+    if (!ck)
+        return;
+    if (ck->sparesBound)
+        restoreSpares(ck);
+    endTrace(ck);
+    if (ck->xferWin != None)
+        endTransfer(ck);
+    if (ck->disp)
+        XCloseDisplay(ck->disp);
+    if (ck->uinputDevice) {
+        /* Whoever reads the device may not have got to the last keys
+         * yet, and they go with it: give them time, as when opening.
+         */
+        usleep(200000);
+        ioctl(ck->uinputFd, UI_DEV_DESTROY);
+    }
+    if (ck->uinputFd > 1)
+        close(ck->uinputFd);
+    free(ck->keymapSyms);
+    free(ck->queue);
+    free(ck->uinputBuf);
+    free(ck->chordKeys);
+    free(ck->pasteBuf);
+    free(ck->targets);
+#ifdef HAVE_XCB
+    free(ck->cookies);
+#endif
+    free(ck);
+}
+
+int crikey_send_string(crikey* ck, const char* s)
+{
+    return crikey_send_batch(ck, &s, 1);
+}
+
+/* What the send functions return: -1 if a wait timed out or memory
+ * ran out, and the rest wasn't typed, else the keys that couldn't be
+ * typed since failed
+ */
+static int sendResult(crikey* ck, unsigned long failed)
+{
+    if (ck->aborted) {
+        ck->aborted = 0;
+        return -1;
+    }
+    return ck->stats.failed - failed;
+}
+
+int crikey_send_batch(crikey* ck, const char* const* strings, int n)
+{
+    unsigned long failed = ck->stats.failed;
+    int i;
+
+    for (i = 0; i < n && !ck->aborted; ++i) {
+        simulateKeyPressForString(ck, strings[i]);
+        if (i < n-1)
+            simulateKeyPress(ck, XK_space, 0);
+    }
+    flushKeyPresses(ck);
+    return sendResult(ck, failed);
+}
+
+int crikey_send_file(crikey* ck, const char* filename)
+{
+    unsigned long failed = ck->stats.failed;
+
+    if (simulateKeyPressForFile(ck, filename) < 0)
+        return -1;
+    return sendResult(ck, failed);
+}
+
+int crikey_send_fd(crikey* ck, int fd)
+{
+    unsigned long failed = ck->stats.failed;
+
+    simulateKeyPressForStream(ck, fd);
+    return sendResult(ck, failed);
+}
+
+int crikey_compile(crikey* ck, FILE* fp)
+{
+    ProgramHeader hdr;
+
+    flushKeyPresses(ck);
+    ck->programOut = 0;
+    if (!fp)
+        return 0;
+    memcpy(hdr.magic, PROGRAM_MAGIC, sizeof hdr.magic);
+    hdr.keymapHash = ck->keymapHash;
+    hdr.reserved = 0;
+    if (fwrite(&hdr, sizeof hdr, 1, fp) != 1)
+        return -1;
+    ck->programOut = fp;
+    return 0;
+}
+
+int crikey_fd(crikey* ck)
+{
+    return ck->disp ? ConnectionNumber(ck->disp) : -1;
+}
+
+void crikey_poll(crikey* ck)
+{
+    handlePendingEvents(ck);
+}
+
+void crikey_get_stats(crikey* ck, crikey_stats* stats)
+{
+    *stats = ck->stats;
+}
@@ -0,0 +1,309 @@
+/*
+ * mkkeysyms: generate keysyms.h for libcrikey from keysymdef.h
+ * (and XF86keysym.h), so typing characters and \(Name\) escapes
+ * needn't call XStringToKeysym:
+ *
+ *   CharKeysyms, the keysym for each byte typed as a character;
+ *   KeysymSlots and KeysymSeeds, a perfect hash table of keysym names.
+ *
+ * Usage: mkkeysyms /usr/include/X11/keysymdef.h [XF86keysym.h] > keysyms.h
+ *
+ * Copyright 2003-2009 by Akkana Peck, http://www.shallowsky.com/software/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keysymhash.h"
+
+/*
+ * Characters whose keysym names aren't the character itself.
+ * Letters and digits are their own names; anything else not here
+ * can't be typed as a character.
+ * List of character definitions is in /usr/include/X11/keysymdef.h
+ * if you need to add anything.
+ */
+static const struct {
+    char ch;
+    char* keySymName;
+} NonPrintables[] =
+{
+    { ' ', "space" },
+    { '\t', "Tab" },
+    { '\n', "Return" },  // for some reason this needs to be cr, not lf
+    { '\r', "Return" },
+    { '\e', "Escape" },
+    { '\010', "BackSpace" },  // \b doesn't work
+    { '\177', "Delete" },
+    { '\27', "Escape" },      // \e doesn't work
+    { '!', "exclam" },
+    { '#', "numbersign" },
+    { '%', "percent" },
+    { '$', "dollar" },
+    { '&', "ampersand" },
+    { '"', "quotedbl" },
+    { '\'', "apostrophe" },
+    { '(', "parenleft" },
+    { ')', "parenright" },
+    { '*', "asterisk" },
+    { '=', "equal" },
+    { '+', "plus" },
+    { ',', "comma" },
+    { '-', "minus" },
+    { '.', "period" },
+    { '/', "slash" },
+    { ':', "colon" },
+    { ';', "semicolon" },
+    { '<', "less" },
+    { '>', "greater" },
+    { '?', "question" },
+    { '@', "at" },
+    { '[', "bracketleft" },
+    { ']', "bracketright" },
+    { '\\', "backslash" },
+    { '^', "asciicircum" },
+    { '_', "underscore" },
+    { '`', "grave" },
+    { '{', "braceleft" },
+    { '|', "bar" },
+    { '}', "braceright" },
+    { '~', "asciitilde" },
+};
+
+/* Header files and the prefix their names have in their #defines,
+ * with what XStringToKeysym calls them instead
+ */
+static const struct {
+    char* prefix;
+    char* name;
+} Prefixes[] = {
+    { "XK_", "" },
+    { "XF86XK_", "XF86" },
+};
+
+typedef struct {
+    char* name;
+    unsigned long keysym;
+    unsigned int hash;      /* unseeded, to pick the bucket */
+} Keysym;
+
+static Keysym* Keysyms = 0;
+static int NumKeysyms = 0;
+
+static unsigned long findKeysym(const char* name)
+{
+    int i;
+
+    for (i = 0; i < NumKeysyms; ++i)
+        if (!strcmp(Keysyms[i].name, name))
+            return Keysyms[i].keysym;
+    return 0;
+}
+
+static int readKeysyms(const char* filename)
+{
+    char line[1024], define[256], name[256];
+    unsigned long keysym;
+    size_t p, len;
+    int size = 0;
+    FILE* fp = fopen(filename, "r");
+
+    if (!fp) {
+        perror(filename);
+        return -1;
+    }
+    while (fgets(line, sizeof line, fp)) {
+        /* Values that aren't plain numbers (_EVDEVK(...)) are left
+         * to XStringToKeysym.
+         */
+        if (sscanf(line, "#define %255s 0x%lx", define, &keysym) != 2)
+            continue;
+        for (p = 0; p < sizeof Prefixes / sizeof *Prefixes; ++p) {
+            len = strlen(Prefixes[p].prefix);
+            if (!strncmp(define, Prefixes[p].prefix, len))
+                break;
+        }
+        if (p == sizeof Prefixes / sizeof *Prefixes)
+            continue;
+        snprintf(name, sizeof name, "%s%s", Prefixes[p].name, define + len);
+        /* The first definition of a name wins */
+        if (findKeysym(name))
+            continue;
+
+        if (NumKeysyms >= size) {
+            size = size ? size * 2 : 4096;
+            Keysyms = realloc(Keysyms, size * sizeof *Keysyms);
+        }
+        if (!Keysyms || !(Keysyms[NumKeysyms].name = strdup(name))) {
+            fprintf(stderr, "mkkeysyms: Out of memory\n");
+            exit(1);
+        }
+        Keysyms[NumKeysyms].keysym = keysym;
+        Keysyms[NumKeysyms].hash = keysymNameHash(name, 0);
+        ++NumKeysyms;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* The character table: what crikey used to get from XStringToKeysym
+ * on the character itself, then the NonPrintables list
+ */
+static void writeCharTable(void)
+{
+    unsigned long keysym;
+    char name[2];
+    int c, i;
+
+    printf("static const KeySym CharKeysyms[256] = {");
+    for (c = 0; c < 256; ++c) {
+        name[0] = c;
+        name[1] = '\0';
+        keysym = c ? findKeysym(name) : 0;
+        for (i = 0; !keysym && i < sizeof NonPrintables
+                                    / sizeof *NonPrintables; ++i)
+            if ((unsigned char)NonPrintables[i].ch == c)
+                keysym = findKeysym(NonPrintables[i].keySymName);
+        printf("%s0x%lx,", c % 8 ? " " : "\n    ", keysym);
+    }
+    printf("\n};\n\n");
+}
+
+/*
+ * The names, hashed and displaced: each name goes in a bucket by its
+ * unseeded hash, then the biggest buckets first, each bucket gets the
+ * first seed that puts all its names in free slots. A lookup is then
+ * two hashes and one string compare.
+ */
+static void writeNameTable(void)
+{
+    int nslots = 1, nbuckets, i, j, b, n;
+    int *sizes, *order, *slotOf, *members;
+    unsigned int* seeds;
+    char* used;
+    unsigned int seed;
+    size_t off;
+
+    while (nslots < NumKeysyms * 3 / 2)
+        nslots *= 2;
+    nbuckets = NumKeysyms / 4 + 1;
+    sizes = calloc(nbuckets, sizeof *sizes);
+    order = malloc(nbuckets * sizeof *order);
+    seeds = calloc(nbuckets, sizeof *seeds);
+    slotOf = malloc(nslots * sizeof *slotOf);
+    members = malloc(NumKeysyms * sizeof *members);
+    used = malloc(nslots);
+    if (!sizes || !order || !seeds || !slotOf || !members || !used) {
+        fprintf(stderr, "mkkeysyms: Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < NumKeysyms; ++i)
+        ++sizes[Keysyms[i].hash % nbuckets];
+
+    /* Biggest buckets first: they're the hardest to place */
+    for (b = 0; b < nbuckets; ++b)
+        order[b] = b;
+    for (i = 1; i < nbuckets; ++i)
+        for (j = i; j > 0 && sizes[order[j]] > sizes[order[j-1]]; --j) {
+            b = order[j];
+            order[j] = order[j-1];
+            order[j-1] = b;
+        }
+
+    memset(used, 0, nslots);
+    for (i = 0; i < nslots; ++i)
+        slotOf[i] = -1;
+    for (i = 0; i < nbuckets && sizes[order[i]]; ++i) {
+        b = order[i];
+        for (n = 0, j = 0; j < NumKeysyms; ++j)
+            if (Keysyms[j].hash % nbuckets == b)
+                members[n++] = j;
+        for (seed = 1; ; ++seed) {
+            for (j = 0; j < n; ++j) {
+                unsigned int slot = keysymNameHash(Keysyms[members[j]].name,
+                                                   seed) & (nslots - 1);
+                if (used[slot])
+                    break;
+                used[slot] = 1;
+                slotOf[slot] = members[j];
+            }
+            if (j == n)
+                break;
+            /* Take back the ones this seed placed */
+            while (j-- > 0) {
+                unsigned int slot = keysymNameHash(Keysyms[members[j]].name,
+                                                   seed) & (nslots - 1);
+                used[slot] = 0;
+                slotOf[slot] = -1;
+            }
+            if (seed == 0xffff) {
+                fprintf(stderr, "mkkeysyms: Can't place bucket %d\n", b);
+                exit(1);
+            }
+        }
+        seeds[b] = seed;
+    }
+
+    printf("#define KEYSYM_SLOTS %d\n", nslots);
+    printf("#define KEYSYM_BUCKETS %d\n\n", nbuckets);
+
+    /* The names, one string, each with a NUL after it */
+    printf("static const char KeysymNames[] =");
+    for (i = 0; i < nslots; ++i)
+        if (slotOf[i] >= 0)
+            printf("\n    \"%s\\0\"", Keysyms[slotOf[i]].name);
+    printf(";\n\n");
+
+    /* name is the offset in KeysymNames plus 1; 0 is an empty slot */
+    printf("static const struct {\n"
+           "    unsigned int name;\n"
+           "    unsigned int keysym;\n"
+           "} KeysymSlots[KEYSYM_SLOTS] = {");
+    for (i = 0, off = 0; i < nslots; ++i) {
+        if (slotOf[i] < 0)
+            printf("%s{ 0, 0 },", i % 4 ? " " : "\n    ");
+        else {
+            printf("%s{ %lu, 0x%lx },", i % 4 ? " " : "\n    ",
+                   (unsigned long)off + 1, Keysyms[slotOf[i]].keysym);
+            off += strlen(Keysyms[slotOf[i]].name) + 1;
+        }
+    }
+    printf("\n};\n\n");
+
+    printf("static const unsigned short KeysymSeeds[KEYSYM_BUCKETS] = {");
+    for (b = 0; b < nbuckets; ++b)
+        printf("%s%u,", b % 10 ? " " : "\n    ", seeds[b]);
+    printf("\n};\n");
+}
+
+int main(int argc, char** argv)
+{
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Usage: mkkeysyms keysymdef.h [XF86keysym.h] > keysyms.h\n");
+        return 1;
+    }
+    for (i = 1; i < argc; ++i)
+        if (readKeysyms(argv[i]) < 0)
+            return 1;
+
+    printf("/* Generated by mkkeysyms from");
+    for (i = 1; i < argc; ++i)
+        printf(" %s", argv[i]);
+    printf(": don't edit */\n\n");
+    writeCharTable();
+    writeNameTable();
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        perror("mkkeysyms");
+        return 1;
+    }
+    return 0;
+}
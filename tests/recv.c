@@ -0,0 +1,93 @@
+/*
+ * recv: the window crikey types into for make check and make bench.
+ * It takes the focus and prints a line for every key event it gets:
+ *
+ *   press|release usec keysym mods servertime
+ *
+ * usec is CLOCK_MONOTONIC when the event was read, in microseconds,
+ * to line up with the times in crikey's --trace. mods is some of
+ * S, C and A (Shift, Control, Mod1), or - for none.
+ * It prints "ready" once it has the focus, then runs until killed.
+ *
+ * Copyright 2003-2009 by Akkana Peck, http://www.shallowsky.com/software/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char** argv)
+{
+    Display* disp = 0;
+    Window win;
+    XEvent ev;
+    KeySym keysym;
+    struct timespec ts;
+    char buf[32], mods[4];
+    char* name;
+    char* m;
+    int i;
+
+    /* Xvfb may still be starting */
+    for (i = 0; i < 50 && !(disp = XOpenDisplay(0)); ++i)
+        usleep(100000);
+    if (!disp) {
+        printf("recv: Can't open display %s\n", XDisplayName(0));
+        return 1;
+    }
+
+    win = XCreateSimpleWindow(disp, DefaultRootWindow(disp),
+                              0, 0, 200, 100, 0, 0, 0);
+    XStoreName(disp, win, "crikey receiver");
+    XSelectInput(disp, win,
+                 KeyPressMask | KeyReleaseMask | StructureNotifyMask);
+    XMapWindow(disp, win);
+    do
+        XNextEvent(disp, &ev);
+    while (ev.type != MapNotify);
+    /* There's no window manager to give us the focus */
+    XSetInputFocus(disp, win, RevertToParent, CurrentTime);
+    XSync(disp, False);
+    printf("ready\n");
+    fflush(stdout);
+
+    for (;;) {
+        XNextEvent(disp, &ev);
+        if (ev.type == MappingNotify) {
+            XRefreshKeyboardMapping(&ev.xmapping);
+            continue;
+        }
+        if (ev.type != KeyPress && ev.type != KeyRelease)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        XLookupString(&ev.xkey, buf, sizeof buf, &keysym, 0);
+        name = XKeysymToString(keysym);
+        m = mods;
+        if (ev.xkey.state & ShiftMask)
+            *m++ = 'S';
+        if (ev.xkey.state & ControlMask)
+            *m++ = 'C';
+        if (ev.xkey.state & Mod1Mask)
+            *m++ = 'A';
+        if (m == mods)
+            *m++ = '-';
+        *m = '\0';
+
+        printf("%s %lld %s %s %lu\n",
+               ev.type == KeyPress ? "press" : "release",
+               ts.tv_sec * 1000000LL + ts.tv_nsec / 1000,
+               name ? name : "NoSymbol", mods, ev.xkey.time);
+        /* Write a burst out when it's over, not a line at a time */
+        if (!XPending(disp))
+            fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,265 @@
+#!/bin/sh
+#
+# crikey's regression checks and benchmark, headless under Xvfb.
+# tests/recv is the window that gets the keys.
+#
+#   tests/run.sh check   type the cases from TESTING with -t and -x
+#                        and check what arrives; exits 1 if any is wrong
+#   tests/run.sh bench   startup time and parser speed with -n (no X
+#                        needed), then keys/sec and per-key latency
+#                        with -t and -x
+#
+# CRIKEY, RECV and XVFB_DISPLAY say which crikey, receiver and display
+# number to use.
+
+CRIKEY=${CRIKEY:-./crikey}
+RECV=${RECV:-tests/recv}
+DISPLAY=${XVFB_DISPLAY:-:57}
+export DISPLAY
+
+tmp=$(mktemp -d) || exit 1
+xvfb=
+recv=
+
+cleanup() {
+    [ -n "$recv" ] && kill $recv 2>/dev/null
+    [ -n "$xvfb" ] && kill $xvfb 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Start Xvfb and the receiver, and wait until the receiver has the focus
+startX() {
+    if ! command -v Xvfb >/dev/null; then
+        echo "Xvfb isn't installed"
+        return 1
+    fi
+    Xvfb $DISPLAY -screen 0 800x600x24 -nolisten tcp >"$tmp/xvfb.log" 2>&1 &
+    xvfb=$!
+    "$RECV" >"$tmp/keys" &
+    recv=$!
+    i=0
+    until grep -q '^ready' "$tmp/keys" 2>/dev/null; do
+        i=$((i + 1))
+        if [ $i -gt 100 ] || ! kill -0 $recv 2>/dev/null; then
+            echo "Couldn't start Xvfb on $DISPLAY with the receiver:"
+            cat "$tmp/xvfb.log" "$tmp/keys"
+            return 1
+        fi
+        sleep 0.1
+    done
+}
+
+# The receiver's lines since line $1
+since() {
+    tail -n +$(($1 + 1)) "$tmp/keys"
+}
+
+# Wait (up to $3 tenths of a second) until there's a line since line $1
+# matching $2
+waitFor() {
+    i=0
+    until since $1 | grep -q "$2"; do
+        i=$((i + 1))
+        [ $i -gt $3 ] && return 1
+        sleep 0.1
+    done
+}
+
+# The keys pressed since line $1, up to the Pause that ends a case:
+# modifiers aren't listed, but C- and A- mark keys typed with
+# Control or Alt held
+typed() {
+    since $1 | awk '
+        $1 != "press" || $3 ~ /^(Shift|Control|Alt|Meta|Super)_/ { next }
+        $3 == "Pause" { exit }
+        {
+            k = $3
+            if ($4 ~ /A/) k = "A-" k
+            if ($4 ~ /C/) k = "C-" k
+            printf "%s%s", sep, k
+            sep = " "
+        }'
+}
+
+failed=0
+
+# checkCase flag string expected: type string, with a Pause after it,
+# and compare what arrived with expected. (printf, since some shells'
+# echo would turn the \e in a string into an escape.)
+checkCase() {
+    start=$(wc -l < "$tmp/keys")
+    if ! "$CRIKEY" $1 "$2\(Pause\)"; then
+        printf "FAIL %s '%s': crikey failed\n" $1 "$2"
+        failed=$((failed + 1))
+        return
+    fi
+    if ! waitFor $start '^press [0-9]* Pause ' 50; then
+        printf "FAIL %s '%s': got '%s' and no Pause\n" \
+               $1 "$2" "$(typed $start)"
+        failed=$((failed + 1))
+        return
+    fi
+    got=$(typed $start)
+    if [ "$got" = "$3" ]; then
+        printf "ok   %s '%s'\n" $1 "$2"
+    else
+        printf "FAIL %s '%s': got '%s', expected '%s'\n" $1 "$2" "$got" "$3"
+        failed=$((failed + 1))
+    fi
+}
+
+check() {
+    for flag in -t -x; do
+        checkCase $flag 'cat < x' 'c a t space less space x'
+        checkCase $flag 'echo > x' 'e c h o space greater space x'
+        checkCase $flag 'cat \(less\) x' 'c a t space less space x'
+        checkCase $flag 'echo \(greater\) x' 'e c h o space greater space x'
+        checkCase $flag '^^' 'asciicircum'
+        checkCase $flag '\CL' 'C-L'
+        checkCase $flag '^L' 'C-l'
+        checkCase $flag '\(Up\)' 'Up'
+        checkCase $flag 'oHere\e' 'o H e r e Escape'
+    done
+    if [ $failed -gt 0 ]; then
+        echo "$failed cases failed"
+        return 1
+    fi
+    echo "All cases passed"
+}
+
+# Nearest-rank percentiles of the sorted numbers on stdin
+percentiles() {
+    awk '{ v[NR] = $1 }
+        function pct(p,    i) {
+            i = int(p * NR)
+            if (i < p * NR) i++
+            if (i < 1) i = 1
+            return v[i]
+        }
+        END {
+            printf "p50 %.3f p90 %.3f p99 %.3f max %.3f ms\n",
+                   pct(.5), pct(.9), pct(.99), v[NR]
+        }'
+}
+
+# benchRun flag: type keys.txt, and compare the time each key press
+# went out (from the --trace) with when the receiver got it
+benchRun() {
+    start=$(wc -l < "$tmp/keys")
+    if ! "$CRIKEY" $1 --trace "$tmp/trace.json" -f "$tmp/keys.txt"; then
+        echo "$1: crikey failed"
+        return 1
+    fi
+    n=$(grep -c '"name":"press"' "$tmp/trace.json")
+    i=0
+    while [ $(since $start | grep -c '^press') -lt $n ]; do
+        i=$((i + 1))
+        if [ $i -gt 100 ]; then
+            echo "$1: only $(since $start | grep -c '^press') of $n" \
+                 "key presses arrived"
+            return 1
+        fi
+        sleep 0.1
+    done
+
+    t0=$(sed -n 's/.*"monotonic_us":\([0-9.]*\).*/\1/p' "$tmp/trace.json")
+    grep '"name":"press"' "$tmp/trace.json" |
+        sed 's/.*"ts":\([0-9.]*\),.*/\1/' |
+        awk -v t0=$t0 '{ printf "%.3f\n", t0 + $1 }' > "$tmp/sent"
+    since $start | awk '$1 == "press" { print $2 }' > "$tmp/got"
+
+    paste "$tmp/sent" "$tmp/got" | awk -v flag=$1 '
+        NR == 1 { first = $1 }
+        { last = $2 }
+        END {
+            printf "%s: %d key presses in %.1f ms, %.0f keys/sec\n",
+                   flag, NR, (last - first) / 1e3, NR * 1e6 / (last - first)
+        }'
+    printf "%s: latency " $1
+    paste "$tmp/sent" "$tmp/got" | awk '{ print ($2 - $1) / 1e3 }' |
+        sort -n | percentiles
+}
+
+# Parser speed with -n, on about 10 MB of generated words: plain text
+# goes through the fast path, and escapes through the full parser.
+# The event hash has to come out the same with the fast path off.
+parseBench() {
+    awk 'BEGIN {
+        srand(1)
+        for (i = 0; i < 1500000; i++) {
+            w = ""
+            for (j = 2 + int(rand() * 8); j > 0; j--)
+                w = w sprintf("%c", 97 + int(rand() * 26))
+            printf "%s%s", w, (i % 12 == 11) ? "\n" : " "
+        }
+    }' > "$tmp/plain.txt"
+    sed "s/e /\\\\(Return\\\\)/g; s/q/^a/g; s/x/\\\\Cx/g" \
+        "$tmp/plain.txt" > "$tmp/mixed.txt"
+
+    for f in plain mixed; do
+        "$CRIKEY" -n --stats -f "$tmp/$f.txt" > "$tmp/fast" &&
+        CRIKEY_NO_FAST_PATH=1 "$CRIKEY" -n --stats -f "$tmp/$f.txt" \
+            > "$tmp/slow" || return 1
+        awk -v f=$f -v size=$(wc -c < "$tmp/$f.txt") '
+            / parse / { ms = $5 + $8 }
+            END {
+                printf "%s: %.1f MB parsed and resolved in %.1f ms," \
+                       " %.1f MB/s\n", f, size / 1e6, ms, size / 1e3 / ms
+            }' "$tmp/fast"
+        fast=$(sed -n 's/.*event hash //p' "$tmp/fast")
+        slow=$(sed -n 's/.*event hash //p' "$tmp/slow")
+        if [ "$fast" != "$slow" ]; then
+            echo "$f: event hash $fast, but $slow without the fast path"
+            return 1
+        fi
+    done
+}
+
+# Startup: what a hotkey pays to type one short string, over 300 runs.
+# Characters and keysym names come from the tables in keysyms.h, so
+# there should be no XStringToKeysym calls.
+startBench() {
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt 300 ]; do
+        "$CRIKEY" -n --stats 'Hello, world!\(Return\)\(Tab\)' || return 1
+        i=$((i + 1))
+    done > "$tmp/start"
+    awk -v ns=$(($(date +%s%N) - start)) '
+        / parse / { p += $5; r += $8; n++ }
+        /XStringToKeysym/ { x += $4 }
+        END {
+            printf "startup: %.2f ms a run, %.4f ms parsing, %.4f ms" \
+                   " resolving, %g XStringToKeysym calls\n",
+                   ns / 1e6 / n, p / n, r / n, x / n
+        }' "$tmp/start"
+}
+
+xBench() {
+    seq -s ' ' 2000 | tr -d '\n' > "$tmp/keys.txt"
+    benchRun -t && benchRun -x
+}
+
+bench() {
+    startBench && parseBench || return 1
+    if ! command -v Xvfb >/dev/null; then
+        echo "Xvfb isn't installed: no keys/sec or latency"
+        return 0
+    fi
+    startX && xBench
+}
+
+case "$1" in
+    check)
+        startX && check
+        ;;
+    bench)
+        bench
+        ;;
+    *)
+        echo "Usage: $0 check|bench"
+        exit 1
+        ;;
+esac